@@ -1,7 +1,12 @@
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "alloc.h"
 #include "util.h"
 
+#ifdef ALLOC_MALLOC
+
 void *do_alloc(size_t size)
 {
 	void *ptr;
@@ -33,3 +38,146 @@ void *do_realloc(void *oldptr, size_t newsize)
 		panic_errno("Could not allocate %lu bytes", (long unsigned)newsize);
 	return newptr;
 }
+
+void alloc_print_stats(FILE *out)
+{
+	fprintf(out, "Allocating with plain malloc\n");
+}
+
+#else
+
+/* Every allocation is preceded by a header telling its size class, 0 for the
+ * ones that were too large for a slab and went to malloc. Objects sitting on a
+ * free list are linked through their header instead.
+ */
+typedef union alloc_header {
+	size_t cls;
+	union alloc_header *next;
+	/* For alignment */
+	void *p;
+	long l;
+	double d;
+} alloc_header;
+
+#define SLAB_GRANULE sizeof(alloc_header)
+/* Largest allocation served out of slabs */
+#define SLAB_MAX 0x100
+#define SLAB_CLASSES (SLAB_MAX / SLAB_GRANULE)
+/* Slabs are carved into objects of any class by bumping a pointer */
+#define SLAB_BYTES 0x10000
+
+static alloc_header *slab_free[SLAB_CLASSES + 1];
+static alloc_header *slab_next = NULL;
+static alloc_header *slab_end = NULL;
+
+static struct {
+	/* Small allocations served from a free list, and by bumping */
+	size_t hits;
+	size_t misses;
+	size_t slab_bytes;
+	/* Bytes of objects, headers included, on the free lists */
+	size_t free_bytes;
+} alloc_stats;
+
+static void *checked_malloc(size_t size)
+{
+	void *ptr = malloc(size);
+	if(!ptr)
+		panic_errno("Could not allocate %lu bytes", (long unsigned)size);
+	return ptr;
+}
+
+static void *slab_alloc(size_t cls)
+{
+	alloc_header *hdr = slab_free[cls];
+	if(hdr) {
+		slab_free[cls] = hdr->next;
+		alloc_stats.free_bytes -= (cls + 1) * SLAB_GRANULE;
+		++alloc_stats.hits;
+	} else {
+		if(!slab_next || slab_end - slab_next < (long)cls + 1) {
+			/* The rest of the slab is wasted, at most SLAB_MAX bytes */
+			slab_next = checked_malloc(SLAB_BYTES);
+			slab_end = slab_next + SLAB_BYTES / SLAB_GRANULE;
+			alloc_stats.slab_bytes += SLAB_BYTES;
+		}
+		hdr = slab_next;
+		slab_next += cls + 1;
+		++alloc_stats.misses;
+	}
+	hdr->cls = cls;
+	return hdr + 1;
+}
+
+void *do_alloc(size_t size)
+{
+	alloc_header *hdr;
+	if(!size)
+		return NULL;
+	if(size <= SLAB_MAX)
+		return slab_alloc((size + SLAB_GRANULE - 1) / SLAB_GRANULE);
+	hdr = checked_malloc(sizeof(alloc_header) + size);
+	hdr->cls = 0;
+	return hdr + 1;
+}
+
+void do_free(void *ptr)
+{
+	alloc_header *hdr;
+	size_t cls;
+	if(!ptr)
+		return;
+	hdr = (alloc_header *)ptr - 1;
+	cls = hdr->cls;
+	if(!cls) {
+		free(hdr);
+		return;
+	}
+	hdr->next = slab_free[cls];
+	slab_free[cls] = hdr;
+	alloc_stats.free_bytes += (cls + 1) * SLAB_GRANULE;
+}
+
+void *do_realloc(void *oldptr, size_t newsize)
+{
+	alloc_header *hdr;
+	void *newptr;
+	size_t oldsize;
+	if(!oldptr)
+		return do_alloc(newsize);
+	if(!newsize) {
+		do_free(oldptr);
+		return NULL;
+	}
+	hdr = (alloc_header *)oldptr - 1;
+	if(!hdr->cls) {
+		/* Stays with malloc even when shrinking */
+		hdr = realloc(hdr, sizeof(alloc_header) + newsize);
+		if(!hdr)
+			panic_errno("Could not allocate %lu bytes",
+				(long unsigned)newsize);
+		return hdr + 1;
+	}
+	oldsize = hdr->cls * SLAB_GRANULE;
+	if(newsize <= oldsize)
+		return oldptr;
+	newptr = do_alloc(newsize);
+	memcpy(newptr, oldptr, oldsize);
+	do_free(oldptr);
+	return newptr;
+}
+
+void alloc_print_stats(FILE *out)
+{
+	size_t unused = alloc_stats.free_bytes
+		+ (size_t)(slab_end - slab_next) * SLAB_GRANULE;
+	fprintf(out, "%lu small allocations, %lu from free lists\n",
+		(long unsigned)(alloc_stats.hits + alloc_stats.misses),
+		(long unsigned)alloc_stats.hits);
+	fprintf(out, "%lu KiB in slabs, %.1f%% of it free\n",
+		(long unsigned)(alloc_stats.slab_bytes / 1024),
+		alloc_stats.slab_bytes
+			? 100.0 * unused / alloc_stats.slab_bytes : 0.0);
+}
+
+#endif
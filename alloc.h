@@ -1,8 +1,15 @@
 #ifndef ALLOC_H_
 #define ALLOC_H_
 
+#include <stdio.h>
 #include <stdlib.h>
 
+/* Allocations of up to 256 bytes are served out of slabs, from a free list per
+ * size class, and never returned to the system. Building with -DALLOC_MALLOC
+ * sends everything straight to malloc instead. Slabs aren't thread-safe: other
+ * threads than the main one may only make larger allocations.
+ */
+
 /* Returns NULL if size is 0 */
 extern void *do_alloc(size_t);
 
@@ -22,4 +29,7 @@ extern void do_free(void *);
 
 #define unallocate(p) do_free(p)
 
+/* Print statistics about small allocations */
+extern void alloc_print_stats(FILE *);
+
 #endif
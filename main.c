@@ -1,9 +1,16 @@
+#include "alloc.h"
+#include "rts/flags.h"
 #include "rts/gc.h"
 
 int main(int argc, char **argv)
 {
+	parse_rts_flags(&argc, argv);
 	gc_collect();
 	
+	if(rts_opts.gc_stats) {
+		gc_print_stats(stderr);
+		alloc_print_stats(stderr);
+	}
 	(void)argc;
 	(void)argv;
 	return 0;
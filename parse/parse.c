@@ -737,7 +737,7 @@ static tree *parse_apat(parser *p)
 			tree **pats_end = &pats;
 			while(1) {
 				tree *pat = try_parser(p, parse_pat);
-				if(!pat) return free(arity), free_tree(pats), NULL;
+				if(!pat) return unallocate(arity), free_tree(pats), NULL;
 				++*arity;
 				*pats_end = new_tree_2(AST_CONS, pat, NULL);
 				pats_end = &(*pats_end)->children[1];
@@ -746,7 +746,7 @@ static tree *parse_apat(parser *p)
 					break;
 				else if(tk.type != TK_COMMA) {
 					lexer_unsee(&p->l, &tk);
-					free(arity);
+					unallocate(arity);
 					free_tree(pats);
 					return NULL;
 				}
@@ -754,7 +754,7 @@ static tree *parse_apat(parser *p)
 			if(*arity == 1) {
 				tree *pat = pats->children[0];
 				pats->children[0] = NULL;
-				free(arity);
+				unallocate(arity);
 				free_tree(pats);
 				return pat;
 			}
@@ -0,0 +1,144 @@
+#define _POSIX_C_SOURCE 200112L
+/* For anonymous mappings */
+#define _DEFAULT_SOURCE
+
+#include <string.h>
+#include <sys/mman.h>
+
+#include "alloc.h"
+#include "block.h"
+#include "flags.h"
+#include "util.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#ifndef MAP_NORESERVE
+#define MAP_NORESERVE 0
+#endif
+
+/* Blocks are carved out of a large range of address space reserved up front,
+ * which is committed a chunk at a time as the heap grows. Another range is
+ * reserved if it ever runs out. Less is reserved where the address space is
+ * too small.
+ */
+#define HEAP_RESERVE ((size_t)0x40000000 << (sizeof(size_t) > 4 ? 6 : 0))
+#define HEAP_COMMIT 0x200000
+
+static char *heap_next = NULL;
+static char *heap_committed = NULL;
+static char *heap_end = NULL;
+
+/* Freed blocks are reused most recently freed first. Blocks that stay unused
+ * from one major collection to the next are released: their memory is
+ * returned to the system, though the address space is kept for reuse.
+ */
+static block *blocks_recent = NULL;
+static block *blocks_idle = NULL;
+static block **blocks_released = NULL;
+static size_t blocks_released_sz = 0;
+static size_t blocks_released_cap = 0;
+
+size_t block_release_count = 0;
+
+static void reserve_heap(void)
+{
+	size_t size = HEAP_RESERVE;
+	void *mem;
+	while((mem = mmap(NULL, size + HEAP_COMMIT, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0)) == MAP_FAILED) {
+		if(size <= HEAP_COMMIT)
+			panic_errno("Could not reserve address space for the heap");
+		size /= 2;
+	}
+	heap_next = (char *)(((size_t)mem + HEAP_COMMIT - 1)
+		& ~(size_t)(HEAP_COMMIT - 1));
+	heap_committed = heap_next;
+	heap_end = heap_next + size;
+#ifdef MADV_HUGEPAGE
+	if(rts_opts.huge_pages)
+		madvise(heap_next, size, MADV_HUGEPAGE);
+#endif
+}
+
+/* Take a block that's never been used from the reserved range */
+static block *fresh_block(void)
+{
+	block *b;
+	if(heap_next == heap_end)
+		reserve_heap();
+	if(heap_next == heap_committed) {
+		if(mprotect(heap_committed, HEAP_COMMIT, PROT_READ | PROT_WRITE))
+			panic_errno("Could not commit %lu bytes of heap",
+				(long unsigned)HEAP_COMMIT);
+		heap_committed += HEAP_COMMIT;
+	}
+	b = (block *)heap_next;
+	heap_next += BLOCK_SIZE;
+	return b;
+}
+
+block *alloc_block(void)
+{
+	block *b;
+	if(blocks_recent) {
+		b = blocks_recent;
+		blocks_recent = b->next;
+	} else if(blocks_idle) {
+		b = blocks_idle;
+		blocks_idle = b->next;
+	} else if(blocks_released_sz)
+		b = blocks_released[--blocks_released_sz];
+	else
+		b = fresh_block();
+	b->next = NULL;
+	b->free = BLOCK_START(b);
+	b->flags = 0;
+	b->forward = NULL;
+	b->owner = NULL;
+	memset(b->marks, 0, sizeof(b->marks));
+	return b;
+}
+
+void free_block(block *b)
+{
+	b->next = blocks_recent;
+	blocks_recent = b;
+}
+
+void release_idle_blocks(void)
+{
+	while(blocks_idle) {
+		block *b = blocks_idle;
+		blocks_idle = b->next;
+		if(blocks_released_sz == blocks_released_cap) {
+			blocks_released_cap = blocks_released_cap
+				? 2 * blocks_released_cap : 0x100;
+			blocks_released = reallocate_arr(block *, blocks_released,
+				blocks_released_cap);
+		}
+		blocks_released[blocks_released_sz++] = b;
+		/* Pages read back as zeroes afterwards, which is fine since blocks
+		 * are set up again when reused
+		 */
+		madvise(b, BLOCK_SIZE, MADV_DONTNEED);
+		++block_release_count;
+	}
+	blocks_idle = blocks_recent;
+	blocks_recent = NULL;
+}
+
+void *alloc_large(size_t bytes)
+{
+	void *mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(mem == MAP_FAILED)
+		panic_errno("Could not map %lu bytes", (long unsigned)bytes);
+	return mem;
+}
+
+void free_large(void *mem, size_t bytes)
+{
+	if(munmap(mem, bytes))
+		panic_errno("Could not unmap %lu bytes", (long unsigned)bytes);
+}
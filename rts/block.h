@@ -0,0 +1,73 @@
+#ifndef BLOCK_H_
+#define BLOCK_H_
+
+#include <limits.h>
+#include <stddef.h>
+
+/* Size of a heap block, including the header. Blocks are aligned to their
+ * size, so the block an object lives in can be found by masking its address.
+ */
+#define BLOCK_SIZE 0x10000
+
+/* Objects are aligned to granules, and every granule has a bit in the mark
+ * bitmap of its block. Keeping the bits out of the objects means marking doesn't
+ * write to them.
+ */
+#define BLOCK_GRANULE sizeof(void *)
+#define BLOCK_MARK_BYTES (BLOCK_SIZE / BLOCK_GRANULE / CHAR_BIT)
+
+/* Objects have been allocated in the block since the last collection */
+#define BLOCK_YOUNG 0x01
+/* The block belongs to a compact region, see gc_new_compact */
+#define BLOCK_COMPACT 0x02
+/* The block is part of the scratch stack, see gc_push_scratch */
+#define BLOCK_SCRATCH 0x04
+
+/* A large chunk of memory that GC-managed objects are carved out of by bumping
+ * a pointer. Objects are laid out back to back right after the header, so a
+ * block can be walked linearly from BLOCK_START to its free pointer.
+ */
+typedef struct block {
+	struct block *next;
+	/* Start of the unused tail of the block */
+	char *free;
+	unsigned char flags;
+	/* Where the collector moves the objects of the block while compacting the
+	 * heap, NULL otherwise
+	 */
+	void *forward;
+	/* The compact region a BLOCK_COMPACT block belongs to */
+	void *owner;
+	unsigned char marks[BLOCK_MARK_BYTES];
+} block;
+
+#define BLOCK_START(b) ((char *)(b) + sizeof(block))
+#define BLOCK_END(b) ((char *)(b) + BLOCK_SIZE)
+#define BLOCK_OF(p) ((block *)((size_t)(p) & ~(size_t)(BLOCK_SIZE - 1)))
+
+/* Index of the granule an object starts at within its block */
+#define BLOCK_GRANULE_OF(p) (((size_t)(p) & (BLOCK_SIZE - 1)) / BLOCK_GRANULE)
+#define BLOCK_MARK_BYTE(p) (&BLOCK_OF(p)->marks[BLOCK_GRANULE_OF(p) / CHAR_BIT])
+#define BLOCK_MARK_BIT(p) (1 << BLOCK_GRANULE_OF(p) % CHAR_BIT)
+
+/* Get a fresh empty block */
+extern block *alloc_block(void);
+
+/* Give a block back. It's kept around for reuse, see release_idle_blocks. */
+extern void free_block(block *);
+
+/* Return the memory of the blocks that have stayed free since the last call to
+ * the system. Called after every major collection.
+ */
+extern void release_idle_blocks(void);
+
+/* Number of times a block's memory has been returned to the system */
+extern size_t block_release_count;
+
+/* Map memory for a single large object straight from the system, and unmap it
+ * right away once it's freed. The size has to be given back.
+ */
+extern void *alloc_large(size_t bytes);
+extern void free_large(void *, size_t bytes);
+
+#endif
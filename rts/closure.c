@@ -2,107 +2,167 @@
 
 #include "alloc.h"
 #include "closure.h"
+#include "gc.h"
 #include "util.h"
 
 void erase_closure(closure *clos)
 {
 	ASSERT(clos);
 	switch(clos->tag) {
+	case CLOSURE_NULL:
+	case CLOSURE_IND:
+		return;
 	case CLOSURE_PRIM:
-		unallocate(clos->u.prim.data);
+		if(clos->u.prim.size > sizeof(prim_word))
+			gc_free_prim_data(clos->u.prim.data.ptr, clos->u.prim.size);
 		return;
 	case CLOSURE_CONSTR:
-		unallocate(clos->u.constr.fields);
+		if(clos->u.constr.nfields > clos->size) {
+			gc_remove_payload(clos->u.constr.nfields * sizeof(closure *));
+			unallocate(clos->u.constr.spill);
+		}
 		return;
 	case CLOSURE_THUNK:
-		unallocate(clos->u.thunk.env);
+	case CLOSURE_BLACKHOLE:
+		if(clos->u.thunk.nenv > clos->size) {
+			gc_remove_payload(clos->u.thunk.nenv * sizeof(closure *));
+			unallocate(clos->u.thunk.spill);
+		}
 		return;
 	default:
         panic("Unknown closure type %d", (int)clos->tag);
 	}
 }
 
-static void free_masked(masked_entry *arr)
+closure *masked_var(env_mask mask, size_t i,
+	closure **env1, size_t len1, closure **env2, size_t len2)
+{
+	size_t j;
+	if(!mask)
+		return NULL;
+	for(j = 0; j < len1 + len2; ++j)
+		if(MASKED(mask, j) && !i--)
+			return j < len1 ? env1[j] : env2[j - len1];
+	return NULL;
+}
+
+closure **init_fields(closure *clos, arity n)
 {
-	if(arr) {
-		masked_entry *ptr;
-		for(ptr = arr; ptr->entry; ++ptr)
-			unallocate(ptr->mask);
-		unallocate(arr);
+	clos->u.constr.nfields = n;
+	if(n > clos->size) {
+		gc_add_payload(n * sizeof(closure *));
+		return clos->u.constr.spill = allocate_arr(closure *, n);
 	}
+	return CLOSURE_PAYLOAD(clos);
 }
 
-void erase_entry(entry *ent)
+closure **init_env(closure *clos, arity n)
 {
-	ASSERT(ent);
-	switch(ent->tag) {
-	case ENTRY_PRIM:
-	case ENTRY_SELECT:
-	case ENTRY_LAM:
-		return;
-	case ENTRY_APPLY:
-		unallocate(ent->u.apply.fun.mask);
-		unallocate(ent->u.apply.arg.mask);
-		return;
-	case ENTRY_CASE:
-		unallocate(ent->u.caseof.scrutinee.mask);
-		free_masked(ent->u.caseof.branches);
-		return;
-	case ENTRY_LETREC:
-		unallocate(ent->u.letrec.body.mask);
-		free_masked(ent->u.letrec.bindings);
-		return;
-	default:
-		panic("Unknown entry type %d", (int)ent->tag);
+	clos->u.thunk.nenv = n;
+	if(n > clos->size) {
+		gc_add_payload(n * sizeof(closure *));
+		return clos->u.thunk.spill = allocate_arr(closure *, n);
 	}
+	return CLOSURE_PAYLOAD(clos);
+}
+
+void *init_prim(closure *clos, size_t size)
+{
+	clos->u.prim.size = size;
+	clos->u.prim.mut = 0;
+	if(size <= sizeof(prim_word))
+		return &clos->u.prim.data;
+	return clos->u.prim.data.ptr = gc_alloc_prim_data(size);
+}
+
+void *prim_data_mut(closure *clos)
+{
+	clos = UNTAG(clos);
+	ASSERT(clos->tag == CLOSURE_PRIM);
+	/* Statics are kept in a compact region too */
+	if(gc_is_compact(clos))
+		panic("Can't update a primitive in a compact region or a static one");
+	clos->u.prim.mut = 1;
+	if(clos->u.prim.size <= sizeof(prim_word))
+		return &clos->u.prim.data;
+	return gc_unshare_prim_data(clos);
 }
 
 void copy_closure(closure *dest, closure *src)
 {
 	ASSERT(dest);
 	ASSERT(src);
+	/* Pointers in the payload stay tagged, their targets are the same */
+	src = UNTAG(src);
 	if(dest == src) return;
+	gc_write_barrier(dest);
 	erase_closure(dest);
 	dest->tag = src->tag;
 	switch(src->tag) {
 	case CLOSURE_PRIM:
-		if(src->u.prim.data) {
-			dest->u.prim.data = do_alloc(src->u.prim.size);
-			memcpy(dest->u.prim.data, src->u.prim.data, src->u.prim.size);
-		} else {
-			dest->u.prim.data = NULL;
-		}
 		dest->u.prim.size = src->u.prim.size;
+		dest->u.prim.mut = 0;
+		if(src->u.prim.size > sizeof(prim_word))
+			dest->u.prim.data.ptr = gc_share_prim_data(src);
+		else
+			dest->u.prim.data = src->u.prim.data;
 		return;
 	case CLOSURE_CONSTR:
 		dest->u.constr.var = src->u.constr.var;
 		dest->u.constr.want_arity = src->u.constr.want_arity;
-		if(src->u.constr.fields) {
-			size_t cnt = 0, i;
-			while(src->u.constr.fields[cnt])
-				++cnt;
-			dest->u.constr.fields = allocate_arr(closure *, cnt + 1);
-			for(i = 0; i <= cnt; ++i)
-				dest->u.constr.fields[i] = src->u.constr.fields[i];
-		} else {
-			dest->u.constr.fields = NULL;
-		}
+		memcpy(init_fields(dest, src->u.constr.nfields), CLOSURE_FIELDS(src),
+			src->u.constr.nfields * sizeof(closure *));
 		return;
 	case CLOSURE_THUNK:
 		dest->u.thunk.entry = src->u.thunk.entry;
 		dest->u.thunk.want_arity = src->u.thunk.want_arity;
-		if(src->u.thunk.env) {
-			size_t cnt = 0, i;
-			while(src->u.thunk.env[cnt])
-				++cnt;
-			dest->u.thunk.env = allocate_arr(closure *, cnt + 1);
-			for(i = 0; i <= cnt; ++i)
-				dest->u.thunk.env[i] = src->u.thunk.env[i];
-		} else {
-			dest->u.thunk.env = NULL;
-		}
+		memcpy(init_env(dest, src->u.thunk.nenv), CLOSURE_ENV(src),
+			src->u.thunk.nenv * sizeof(closure *));
+		return;
+	case CLOSURE_IND:
+		dest->u.ind = src->u.ind;
 		return;
 	default:
         panic("Unknown closure type %d", (int)src->tag);
 	}
 }
+
+void set_indirection(closure *dest, closure *target)
+{
+	ASSERT(dest);
+	target = deref(target);
+	if(dest == target) return;
+	gc_write_barrier(dest);
+	erase_closure(dest);
+	dest->tag = CLOSURE_IND;
+	dest->u.ind = target;
+}
+
+closure *deref(closure *clos)
+{
+	clos = UNTAG(clos);
+	while(clos->tag == CLOSURE_IND)
+		clos = clos->u.ind;
+	return clos;
+}
+
+closure *tag_pointer(closure *clos)
+{
+	closure *val = deref(clos);
+	switch(val->tag) {
+	case CLOSURE_CONSTR:
+		if(!val->u.constr.want_arity
+			&& val->u.constr.var < PTR_TAG_EVALUATED - 1)
+			return (closure *)((size_t)val | (val->u.constr.var + 1));
+		break;
+	case CLOSURE_PRIM:
+		break;
+	case CLOSURE_THUNK:
+		if(val->u.thunk.want_arity)
+			break;
+		return val;
+	default:
+		return val;
+	}
+	return (closure *)((size_t)val | PTR_TAG_EVALUATED);
+}
@@ -1,30 +1,73 @@
 #ifndef CLOSURE_H_
 #define CLOSURE_H_
 
+#include <limits.h>
 #include <stddef.h>
 
 enum closure_tag {
 	CLOSURE_NULL = 0x00,
 	CLOSURE_PRIM,
 	CLOSURE_CONSTR,
-	CLOSURE_THUNK
+	CLOSURE_THUNK,
+	CLOSURE_IND,
+	CLOSURE_BLACKHOLE
 };
 
 typedef unsigned char variant;
 typedef unsigned char gc_data;
 typedef unsigned short int arity;
 
-/* A heap-allocated closure, managed by the GC */
+/* Closures are aligned to at least 8 bytes, and pointers to them stored in
+ * fields and environments may carry a tag in their low bits. Tags 1 to
+ * PTR_TAG_EVALUATED - 1 mean the closure is a saturated constructor of variant
+ * tag - 1, PTR_TAG_EVALUATED that it's in WHNF otherwise, and 0 that nothing
+ * is known. A closure never goes back from WHNF, so the collector and the
+ * evaluator tag pointers whenever they come across closures in WHNF: the
+ * collector as it scans payloads, the evaluator as it stores arguments and
+ * once a case has evaluated a variable. Such pointers have to be untagged
+ * before they're dereferenced, deref does that.
+ */
+#define PTR_TAG_MASK 0x7
+#define PTR_TAG_EVALUATED 0x7
+#define PTR_TAG(p) ((int)((size_t)(p) & PTR_TAG_MASK))
+#define UNTAG(p) ((closure *)((size_t)(p) & ~(size_t)PTR_TAG_MASK))
+
+/* Primitive data of up to a machine word, such as an Int, a Char or a Double,
+ * is stored in the closure itself
+ */
+typedef union prim_word {
+	void *ptr;
+	long word;
+	double dbl;
+} prim_word;
+
+/* Payloads longer than this are never stored inline */
+#define CLOSURE_MAX_INLINE 16
+
+/* A heap-allocated closure, managed by the GC. Constructor fields and thunk
+ * environments are stored inline right after the closure, with room for size
+ * pointers. A payload that doesn't fit (because the closure was overwritten
+ * with a larger value) is spilled into a separate allocation owned by the
+ * closure.
+ */
 typedef struct closure {
 	char tag;
 	gc_data gc;
+	/* Number of payload pointers allocated inline, fixed for the lifetime of
+	 * the closure
+	 */
+	arity size;
 	union {
-		/* tag = CLOSURE_PRIM, an evaluated primitive datatype value
-		 * prim points to an arbitrarily sized allocation owned by the closure
+		/* tag = CLOSURE_PRIM, an evaluated primitive datatype value of size
+		 * bytes. If that's more than fits in data, data.ptr points to an
+		 * allocation shared by the closure and its copies, which is immutable
+		 * (see prim_data_mut). Use CLOSURE_PRIM_DATA.
 		 */
 		struct {
-			void *data;
+			prim_word data;
 			size_t size;
+			/* Set by prim_data_mut, the closure mustn't be shared */
+			char mut;
 		} prim;
 		/* tag = CLOSURE_CONSTR, an evaluated algebraic datatype value */
 		struct {
@@ -34,27 +77,57 @@ typedef struct closure {
 			 * applied. 0 means it's fully applied.
 			 */
 			arity want_arity;
-			/* A NULL-terminated list of fields of the constructor, allocation
-			 * owned by the closure.
-			 */
-			struct closure **fields;
+			/* Number of fields of the constructor */
+			arity nfields;
+			/* Fields, if there are more than size of them */
+			struct closure **spill;
 		} constr;
-		/* tag = CLOSURE_THUNK, either a thunk or a lambda */
+		/* tag = CLOSURE_THUNK, either a thunk or a lambda. Also used by
+		 * CLOSURE_BLACKHOLE, a thunk under evaluation. The environment of a
+		 * blackhole isn't traced by the collector, whatever's still needed of
+		 * it is kept alive by the evaluation (see gc_push_frame).
+		 */
 		struct {
 			/* How many arguments is the thunk missing. 0 means it's a thunk not
 			 * in WHNF. >0 means it's a lambda in WHNF.
 			 */
 			arity want_arity;
-			/* A NULL-terminated list of the values that the closure is closed
-			 * over, allocation owned by the closure.
-			 */
-			struct closure **env;
+			/* Number of values the closure is closed over */
+			arity nenv;
+			/* Environment, if there are more than size values in it */
+			struct closure **spill;
 			/* Entry "code" */
 			struct entry *entry;
 		} thunk;
+		/* tag = CLOSURE_IND, a thunk that has been evaluated to another
+		 * closure, which is in WHNF and never an indirection itself
+		 */
+		struct closure *ind;
+		/* A dead closure (see gc_live_closure), next in the allocator's free
+		 * list.
+		 */
+		struct closure *next_free;
 	} u;
 } closure;
 
+/* The inline payload area of a closure */
+#define CLOSURE_PAYLOAD(c) ((closure **)((c) + 1))
+
+/* Fields of a constructor */
+#define CLOSURE_FIELDS(c) ((c)->u.constr.nfields > (c)->size \
+	? (c)->u.constr.spill : CLOSURE_PAYLOAD(c))
+
+/* Environment of a thunk */
+#define CLOSURE_ENV(c) ((c)->u.thunk.nenv > (c)->size \
+	? (c)->u.thunk.spill : CLOSURE_PAYLOAD(c))
+
+/* Data of a primitive */
+#define CLOSURE_PRIM_DATA(c) ((c)->u.prim.size > sizeof(prim_word) \
+	? (c)->u.prim.data.ptr : (void *)&(c)->u.prim.data)
+
+/* Size in bytes of a closure with the given inline payload */
+#define CLOSURE_BYTES(size) (sizeof(closure) + (size) * sizeof(closure *))
+
 enum entry_tag {
 	ENTRY_PRIM = 0x01,
 	ENTRY_REF,
@@ -62,7 +135,8 @@ enum entry_tag {
 	ENTRY_APPLY,
 	ENTRY_CASE,
 	ENTRY_LETREC,
-	ENTRY_LAM
+	ENTRY_LAM,
+	ENTRY_BIND
 };
 
 /* A bitmask specifying a subset of the environment to be passed to the child
@@ -70,6 +144,15 @@ enum entry_tag {
  */
 typedef unsigned char *env_mask;
 
+/* Whether a mask selects the variable at index i */
+#define MASKED(mask, i) ((mask)[(i) / CHAR_BIT] & (1 << ((i) % CHAR_BIT)))
+
+/* The closure at index i of the environment a mask selects out of the
+ * concatenation of two environments
+ */
+extern struct closure *masked_var(env_mask mask, size_t i,
+	struct closure **env1, size_t len1, struct closure **env2, size_t len2);
+
 typedef struct masked_entry {
 	/* Pointer never shared */
 	env_mask mask;
@@ -77,13 +160,17 @@ typedef struct masked_entry {
 } masked_entry;
 
 /* Entry code for a thunk or function, instructions on how to replace the
- * closure with an evaluated version of itself. Managed by the GC.
+ * closure with an evaluated version of itself. Entries are never freed, see
+ * new_entry.
  */
 typedef struct entry {
 	char tag;
-	gc_data gc;
 	union {
-		/* tag = ENTRY_PRIM, apply a primitive function */
+		/* tag = ENTRY_PRIM, apply a primitive function. It overwrites self
+		 * with the result, and mustn't keep a reference to self around. The
+		 * environment goes with it, so it mustn't do anything that may
+		 * collect after that.
+		 */
 		int (*prim)(closure *self);
 		/* tag = ENTRY_REF, refer to another closure */
 		closure *ref;
@@ -113,12 +200,30 @@ typedef struct entry {
 			masked_entry body;
 			/* A NULL-terminated list of bindings. */
 			masked_entry *bindings;
+			/* Set up by the evaluator the first time a group of several
+			 * bindings is entered: what they need out of the environment and
+			 * out of each other, which they share, and an ENTRY_BIND entry
+			 * for each of them. NULL until then.
+			 */
+			env_mask frame_mask;
+			struct entry **shared;
 		} letrec;
 		/* tag = ENTRY_LAM, a lambda, request an additional argument */
 		struct {
 			/* How to construct the body once applied to an argument */
 			struct entry *body;
 		} lambda;
+		/* tag = ENTRY_BIND, a binding of a letrec group whose only variable
+		 * is the frame shared by the group. Takes its own environment out of
+		 * the frame, then runs the binding.
+		 */
+		struct {
+			struct entry *group;
+			arity idx;
+			/* Size of the environment of the group, including the bindings
+			 */
+			arity width;
+		} bind;
 	} u;
 } entry;
 
@@ -126,10 +231,39 @@ typedef struct entry {
  */
 extern void erase_closure(closure *);
 
-/* Deallocate all data in an entry */
-extern void erase_entry(entry *);
-
 /* Replace all data of one closure by that of another */
 extern void copy_closure(closure *dest, closure *src);
 
+/* Overwrite a closure with an indirection to another */
+extern void set_indirection(closure *dest, closure *target);
+
+/* Untag a pointer and follow indirections to the closure holding the actual
+ * value
+ */
+extern closure *deref(closure *);
+
+/* A pointer to the value of a closure, tagged with what's known about it */
+extern closure *tag_pointer(closure *);
+
+/* Set the number of fields of a constructor (or the size of the environment of
+ * a thunk) that has just been erased, and return where they are to be stored.
+ */
+extern closure **init_fields(closure *, arity n);
+extern closure **init_env(closure *, arity n);
+
+/* Allocate size bytes of data for a primitive closure that has just been
+ * erased, and return it. Primitive data should be allocated this way so that
+ * the collector accounts for it. Nothing is allocated for data that fits in
+ * the closure.
+ */
+extern void *init_prim(closure *, size_t size);
+
+/* The data of a primitive, for updating it in place. Data shared with copies
+ * of the primitive is copied first. A primitive that's going to be updated
+ * has to go through it before anything that may collect runs, or a collection
+ * may swap references to it for a shared closure (see gc_static_word). Static
+ * primitives and those in compact regions can't be updated.
+ */
+extern void *prim_data_mut(closure *);
+
 #endif
@@ -0,0 +1,148 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "flags.h"
+#include "util.h"
+
+rts_flags rts_opts = {
+	0,
+	0,
+	1,
+	2.0,
+	0x400000,
+	0,
+	0,
+	1,
+	-16,
+	255,
+	0,
+	0x10000,
+	0,
+	0x10000000
+};
+
+/* Parse the numeric argument of an option */
+static size_t parse_num(char const *arg, char const *num)
+{
+	char *end;
+	unsigned long val = strtoul(num, &end, 10);
+	if(!*num || *end)
+		panic("Invalid number in RTS option: %s", arg);
+	return val;
+}
+
+/* Parse a growth factor, at least 1 */
+static double parse_factor(char const *arg, char const *num)
+{
+	char *end;
+	double val = strtod(num, &end);
+	if(!*num || *end || !(val >= 1))
+		panic("Invalid factor in RTS option: %s", arg);
+	return val;
+}
+
+/* Parse a fraction, more than 0 and at most 1 */
+static double parse_fraction(char const *arg, char const *num)
+{
+	char *end;
+	double val = strtod(num, &end);
+	if(!*num || *end || !(val > 0 && val <= 1))
+		panic("Invalid fraction in RTS option: %s", arg);
+	return val;
+}
+
+/* Parse a range of the form <min>,<max> */
+static void parse_range(char const *arg, char const *num, long *min, long *max)
+{
+	char *end;
+	*min = strtol(num, &end, 10);
+	if(end == num || *end != ',')
+		panic("Invalid range in RTS option: %s", arg);
+	num = end + 1;
+	*max = strtol(num, &end, 10);
+	if(end == num || *end || *max < *min)
+		panic("Invalid range in RTS option: %s", arg);
+}
+
+/* Parse a size in bytes, optionally suffixed with k, m or g */
+static size_t parse_size(char const *arg, char const *num)
+{
+	char *end;
+	unsigned long val = strtoul(num, &end, 10);
+	if(!*num || end == num)
+		panic("Invalid size in RTS option: %s", arg);
+	switch(*end) {
+	case 'g': case 'G':
+		val *= 1024;
+		/* fallthrough */
+	case 'm': case 'M':
+		val *= 1024;
+		/* fallthrough */
+	case 'k': case 'K':
+		val *= 1024;
+		++end;
+		break;
+	}
+	if(*end)
+		panic("Invalid size in RTS option: %s", arg);
+	return val;
+}
+
+static void parse_rts_flag(char const *arg)
+{
+	if(!strcmp(arg, "-s"))
+		rts_opts.gc_stats = 1;
+	else if(!strncmp(arg, "-I", 2))
+		rts_opts.gc_slice = parse_num(arg, arg + 2);
+	else if(!strncmp(arg, "-qn", 3))
+		rts_opts.gc_threads = parse_num(arg, arg + 3);
+	else if(!strncmp(arg, "-F", 2))
+		rts_opts.heap_factor = parse_factor(arg, arg + 2);
+	else if(!strncmp(arg, "-H", 2))
+		rts_opts.heap_min = parse_size(arg, arg + 2);
+	else if(!strncmp(arg, "-M", 2))
+		rts_opts.heap_max = parse_size(arg, arg + 2);
+	else if(!strncmp(arg, "-L", 2))
+		rts_opts.heap_limit = parse_size(arg, arg + 2);
+	else if(!strncmp(arg, "-K", 2))
+		rts_opts.stack_max = parse_size(arg, arg + 2);
+	else if(!strcmp(arg, "-T"))
+		rts_opts.huge_pages = 1;
+	else if(!strcmp(arg, "-Beager"))
+		rts_opts.eager_blackholing = 1;
+	else if(!strcmp(arg, "-Blazy"))
+		rts_opts.eager_blackholing = 0;
+	else if(!strcmp(arg, "-c"))
+		rts_opts.compact_threshold = 0.5;
+	else if(!strncmp(arg, "-c", 2))
+		rts_opts.compact_threshold = parse_fraction(arg, arg + 2);
+	else if(!strncmp(arg, "-P", 2))
+		rts_opts.large_object_min = parse_size(arg, arg + 2);
+	else if(!strncmp(arg, "-W", 2)) {
+		parse_range(arg, arg + 2, &rts_opts.static_word_min,
+			&rts_opts.static_word_max);
+		/* Unsigned, so that the difference can't overflow */
+		if((unsigned long)rts_opts.static_word_max
+			- (unsigned long)rts_opts.static_word_min >= STATIC_WORDS_MAX)
+			panic("Too many static words: %s", arg);
+	} else
+		panic("Unknown RTS option: %s", arg);
+}
+
+void parse_rts_flags(int *argc, char **argv)
+{
+	int i, j, in_rts = 0;
+	for(i = j = 1; i < *argc; ++i)
+		if(!strcmp(argv[i], "+RTS"))
+			in_rts = 1;
+		else if(!strcmp(argv[i], "-RTS"))
+			in_rts = 0;
+		else if(in_rts)
+			parse_rts_flag(argv[i]);
+		else
+			argv[j++] = argv[i];
+	argv[j] = NULL;
+	*argc = j;
+	if(!rts_opts.gc_threads)
+		panic("Need at least one marking thread");
+}
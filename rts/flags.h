@@ -0,0 +1,70 @@
+#ifndef FLAGS_H_
+#define FLAGS_H_
+
+#include <stddef.h>
+
+/* Most word values -W can be given static closures for */
+#define STATIC_WORDS_MAX 0x10000
+
+/* Runtime options, set from the command line between +RTS and -RTS */
+typedef struct rts_flags {
+	/* -s: print collector statistics on exit */
+	int gc_stats;
+	/* -I<n>: mark the heap incrementally during major collections, scanning
+	 * n objects for every 8 KiB allocated, and whatever the write barrier
+	 * adds. 0 means major collections stop the world.
+	 */
+	size_t gc_slice;
+	/* -qn<n>: number of threads marking the heap during collections that stop
+	 * the world
+	 */
+	size_t gc_threads;
+	/* -F<f>: let the old generation grow to f times its size after the last
+	 * major collection before running another one
+	 */
+	double heap_factor;
+	/* -H<size>: don't run major collections while the old generation is
+	 * smaller than this
+	 */
+	size_t heap_min;
+	/* -M<size>: run major collections often enough to keep the old generation
+	 * under this size, if possible. 0 means no maximum.
+	 */
+	size_t heap_max;
+	/* -L<size>: abort once the heap can't be collected down to this size.
+	 * 0 means no limit.
+	 */
+	size_t heap_limit;
+	/* -Beager, -Blazy: blackhole thunks as soon as they're entered, or only
+	 * once a collection happens during their evaluation. Eager blackholing
+	 * releases environments sooner and catches every loop, lazy blackholing is
+	 * cheaper but only catches loops that allocate enough to collect.
+	 */
+	int eager_blackholing;
+	/* -W<min>,<max>: share static closures for word values in this range
+	 * instead of allocating them, at most STATIC_WORDS_MAX of them.
+	 */
+	long static_word_min;
+	long static_word_max;
+	/* -c[<f>]: compact the heap during major collections that find more than
+	 * a fraction f (0.5 if not given) of it free. 0 means never compact.
+	 */
+	double compact_threshold;
+	/* -P<size>: give primitive data of at least this size a mapping of its
+	 * own in the large-object space. 0 means never.
+	 */
+	size_t large_object_min;
+	/* -T: back the heap with transparent huge pages where available */
+	int huge_pages;
+	/* -K<size>: abort once the evaluation stack grows past this size.
+	 * 0 means no limit.
+	 */
+	size_t stack_max;
+} rts_flags;
+
+extern rts_flags rts_opts;
+
+/* Parse runtime options out of the command line, removing them from argv */
+extern void parse_rts_flags(int *argc, char **argv);
+
+#endif
@@ -1,178 +1,1848 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "block.h"
 #include "data.h"
+#include "flags.h"
 #include "gc.h"
 #include "util.h"
 
-/* List of all allocated closures */
-static ptr_list gc_closure_list = NULL;
-size_t gc_closure_list_sz = 0;
-/* List of all allocated entries */
-static ptr_list gc_entry_list = NULL;
-size_t gc_entry_list_sz = 0;
+/* Closures are carved out of blocks by bumping a pointer. The first block in
+ * the list is the one currently being bump-allocated into.
+ */
+static block *gc_blocks = NULL;
+/* Dead closures threaded through their bodies, reused before bumping. One
+ * list for every inline payload size.
+ */
+static closure *gc_free_closures[CLOSURE_MAX_INLINE + 1];
+/* Number of live (or not yet collected) closures */
+size_t gc_closure_count = 0;
+/* Entries are program code and stay around for as long as the program does.
+ * They're bump-allocated out of blocks the collector never looks at. Only the
+ * closures that ENTRY_REF entries refer to are taken as roots.
+ */
+static block *gc_entry_blocks = NULL;
+static entry **gc_entry_refs = NULL;
+static size_t gc_entry_refs_sz = 0;
+static size_t gc_entry_refs_cap = 0;
+/* Number of ENTRY_REF entries that existed at the time of the last collection
+ */
+static size_t gc_old_refs = 0;
+/* Number of entries allocated */
+size_t gc_entry_count = 0;
+
+struct gc_compact {
+	block *blocks;
+	/* Allocations too large for a block */
+	ptr_list large;
+	size_t bytes;
+	/* Whether the program still holds the region, see gc_free_compact */
+	int held;
+	/* Whether a closure in the region has been reached by the major
+	 * collection in progress, or the last one
+	 */
+	int marked;
+	struct gc_compact *next;
+};
+
+/* Every compact region that hasn't been freed yet */
+static gc_compact *gc_regions = NULL;
+
+/* Bytes taken up by all compact regions */
+size_t gc_compact_bytes = 0;
+
+/* Bytes of primitive data in the large-object space. They count towards the
+ * heap as well, so that they drive collections.
+ */
+static size_t gc_large_bytes = 0;
 
-/* Sum of the two list sizes after last collection */
+/* Bytes taken up by objects that are live or not yet collected, including
+ * memory they hold outside of the heap blocks
+ */
+size_t gc_used_bytes = 0;
+/* Bytes allocated since the last collection */
+size_t gc_allocated = 0;
+/* Bytes in use right after the last major collection */
 size_t last_collection = 0;
 
-/* During a walk indicates that we have visited this node */
-#define GC_SEEN   0x01
+/* Objects allocated since the last collection make up the young generation,
+ * and a minor collection is run once they take up this many bytes.
+ */
+#define GC_NURSERY 0x100000
+
+/* The scratch stack, its top block first, and an emptied block kept around so
+ * that popping and pushing across a block boundary doesn't allocate
+ */
+static block *gc_scratch = NULL;
+static block *gc_scratch_spare = NULL;
+
+/* Old closures that have been overwritten since the last collection, and might
+ * now point to young closures.
+ */
+static closure **gc_remembered = NULL;
+static size_t gc_remembered_sz = 0;
+static size_t gc_remembered_cap = 0;
+
 /* Indicates a node currently being manipulated */
 #define GC_USED   0x02
 /* Indicates a "root", such as a global binding */
 #define GC_PINNED 0x04
 #define GC_REFERRED (GC_USED | GC_PINNED)
-#define GC_DEAD   0xF8
+/* Survived a collection, only traced by major collections */
+#define GC_OLD    0x08
+/* In the remembered set */
+#define GC_REMEMBERED 0x10
+/* In the table of pinned, or of used closures */
+#define GC_PIN_LISTED 0x20
+#define GC_USE_LISTED 0x40
+/* Being evaluated, set on frame thunks while the heap is compacted */
+#define GC_FRAMED 0x01
+#define GC_DEAD   0x80
 
-void gc_pin(closure *clos) { clos->gc |= GC_PINNED; }
-void gc_unpin(closure *clos) { clos->gc &= ~GC_PINNED; }
+/* Whether the collection in progress is a minor one */
+static int gc_minor;
 
-void gc_use_entry(entry *ent) { ent->gc |= GC_USED; }
-void gc_unuse_entry(entry *ent) { ent->gc &= ~GC_USED; }
-void gc_use_closure(closure *clos) { clos->gc |= GC_USED; }
-void gc_unuse_closure(closure *clos) { clos->gc &= ~GC_USED; }
+/* A major collection can be run incrementally: its marking is done in slices
+ * of rts_opts.gc_slice objects for every GC_SLICE_BYTES allocated, with the
+ * mutator running in between. The snapshot-at-the-beginning invariant is kept
+ * by the write barrier and by allocating new objects already marked. Minor
+ * collections are put off until the marking is complete, and so the marking
+ * is finished without interruption once the heap has outgrown its target by
+ * as much again.
+ */
+static int gc_marking = 0;
+#define GC_SLICE_BYTES 0x2000
+/* Bytes allocated when the marking started, and when the last slice ran */
+static size_t gc_mark_start = 0;
+static size_t gc_slice_start = 0;
+/* Objects pushed by the write barrier since the last slice, which it has to
+ * scan on top of its budget to keep up
+ */
+static size_t gc_barrier_pushed = 0;
 
-int gc_live_closure(closure *clos) { return !(clos->gc & GC_DEAD); }
-int gc_live_entry(entry *ent) { return !(ent->gc & GC_DEAD); }
+/* Pinned and used closures, so that collections start from them rather than
+ * from a look at every closure in the heap. A closure is listed once, and
+ * unpinning or unusing it only clears its bit: the entry is dropped the next
+ * time the table is pruned. Closures outside of the heap are never listed.
+ */
+typedef struct root_table {
+	closure **items;
+	size_t sz;
+	size_t cap;
+	gc_data bit;
+	gc_data listed;
+} root_table;
 
-/* Simple depth-first mark-and-sweep */
-static int walk_closure(closure *);
+static root_table gc_pins = {NULL, 0, 0, GC_PINNED, GC_PIN_LISTED};
+static root_table gc_uses = {NULL, 0, 0, GC_USED, GC_USE_LISTED};
 
-/* Return int so we can tail call */
-static int walk_entry(entry *ent)
+static void list_root(root_table *t, closure *clos)
 {
-	ASSERT(ent);
-	ASSERT(!(ent->gc & GC_DEAD));
-	if(ent->gc & GC_SEEN) return 0;
-	ent->gc |= GC_SEEN;
-	switch(ent->tag) {
-	case ENTRY_PRIM:
-	case ENTRY_SELECT:
-		return 0;
-	case ENTRY_REF:
-		return walk_closure(ent->u.ref);
-	case ENTRY_APPLY:
-		walk_entry(ent->u.apply.fun.entry);
-		return walk_entry(ent->u.apply.arg.entry);
-	case ENTRY_CASE:
-		if(ent->u.caseof.branches) {
-			masked_entry *ptr;
-			for(ptr = ent->u.caseof.branches; ptr->entry; ++ptr)
-				walk_entry(ptr->entry);
-		}
-		return walk_entry(ent->u.caseof.scrutinee.entry);
-	case ENTRY_LETREC:
-		if(ent->u.letrec.bindings) {
-			masked_entry *ptr;
-			for(ptr = ent->u.letrec.bindings; ptr->entry; ++ptr)
-				walk_entry(ptr->entry);
-		}
-		return walk_entry(ent->u.letrec.body.entry);
-	case ENTRY_LAM:
-		return walk_entry(ent->u.lambda.body);
-	default:
-		panic("Unknown entry type %d", (int)ent->tag);
-		return 0;
+	if(t->sz == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 0x100;
+		t->items = reallocate_arr(closure *, t->items, t->cap);
 	}
+	t->items[t->sz++] = clos;
+	clos->gc |= t->listed;
 }
 
-/* Return int so we can tail call */
-static int walk_closure(closure *clos)
+static void set_root(root_table *t, closure *clos)
 {
-	ASSERT(clos);
-	ASSERT(!(clos->gc & GC_DEAD));
-	if(clos->gc & GC_SEEN) return 0;
-	clos->gc |= GC_SEEN;
+	clos = UNTAG(clos);
+	if(BLOCK_OF(clos)->flags & (BLOCK_COMPACT | BLOCK_SCRATCH))
+		return;
+	if(!(clos->gc & t->listed))
+		list_root(t, clos);
+	clos->gc |= t->bit;
+}
+
+static void clear_root(root_table *t, closure *clos)
+{
+	clos = UNTAG(clos);
+	if(BLOCK_OF(clos)->flags & (BLOCK_COMPACT | BLOCK_SCRATCH))
+		return;
+	clos->gc &= ~t->bit;
+}
+
+/* Drop the entries that lost their bit, before any of them can be freed */
+static void prune_roots(root_table *t)
+{
+	size_t i, j = 0;
+	for(i = 0; i < t->sz; ++i)
+		if(t->items[i]->gc & t->bit)
+			t->items[j++] = t->items[i];
+		else
+			t->items[i]->gc &= ~t->listed;
+	t->sz = j;
+}
+
+void gc_pin(closure *clos) { set_root(&gc_pins, clos); }
+void gc_unpin(closure *clos) { clear_root(&gc_pins, clos); }
+
+void gc_use_closure(closure *clos) { set_root(&gc_uses, clos); }
+void gc_unuse_closure(closure *clos) { clear_root(&gc_uses, clos); }
+
+int gc_live_closure(closure *clos) { return !(UNTAG(clos)->gc & GC_DEAD); }
+
+#ifdef __GNUC__
+#define PREFETCH(p) __builtin_prefetch(p)
+#else
+#define PREFETCH(p) ((void)0)
+#endif
+
+/* Mark-and-sweep driven by an explicit stack of closures still to be scanned.
+ * Closures are pushed without looking at them and a prefetch is issued right
+ * away, so by the time they're popped their header is likely in cache.
+ */
+typedef struct mark_stack {
+	closure **items;
+	size_t sz;
+	size_t cap;
+} mark_stack;
+
+/* Stop-the-world marking can be spread over rts_opts.gc_threads threads. Each
+ * of them marks from its own stack, and hands half of it over to its shared
+ * stack whenever that's empty and some other worker is idle. Idle workers steal
+ * from the shared stacks of the others. Incremental slices and the write
+ * barrier only ever use the first worker.
+ */
+typedef struct gc_worker {
+	mark_stack local;
+	mark_stack shared;
+	pthread_mutex_t lock;
+	size_t marked;
+	size_t peak;
+	size_t steals;
+	size_t shortcuts;
+} gc_worker;
+
+static gc_worker *gc_workers = NULL;
+static size_t gc_nworkers = 0;
+/* Whether the marking in progress is done by several threads */
+static int gc_parallel = 0;
+/* Number of workers that have run out of work */
+static volatile size_t gc_idle = 0;
+
+#ifdef __GNUC__
+#define ATOMIC_OR(p, v) __sync_fetch_and_or(p, v)
+#define ATOMIC_ADD(p, v) __sync_fetch_and_add(p, v)
+#define ATOMIC_SUB(p, v) __sync_fetch_and_sub(p, v)
+#else
+/* Without atomics marking is never run in parallel */
+#define ATOMIC_OR(p, v) (panic("No atomics"), 0)
+#define ATOMIC_ADD(p, v) (panic("No atomics"), 0)
+#define ATOMIC_SUB(p, v) (panic("No atomics"), 0)
+#endif
+
+static struct {
+	size_t collections;
+	size_t minor_collections;
+	size_t marked;
+	size_t peak_mark_stack;
+	size_t slices;
+	size_t steals;
+	size_t shortcuts;
+	size_t lazy_swept;
+	size_t scratch;
+	size_t compactions;
+	size_t compacted_bytes;
+	size_t peak_bytes;
+	size_t large_objects;
+	size_t peak_large_bytes;
+	double mark_time;
+	double max_pause;
+} gc_stats;
+
+/* Wall clock time in seconds, so that parallel marking is timed fairly */
+static double gc_time(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void grow_stack(mark_stack *stk, size_t need)
+{
+	if(need > stk->cap) {
+		while(need > stk->cap)
+			stk->cap = stk->cap ? 2 * stk->cap : 0x100;
+		stk->items = reallocate_arr(closure *, stk->items, stk->cap);
+	}
+}
+
+static void push_closure(gc_worker *w, closure *clos)
+{
+	block *b;
+	clos = UNTAG(clos);
+	b = BLOCK_OF(clos);
+	if(b->flags & (BLOCK_COMPACT | BLOCK_SCRATCH)) {
+		/* A region is kept alive as a whole, and never traced into */
+		if(b->flags & BLOCK_COMPACT && !gc_minor
+			&& !((gc_compact *)b->owner)->marked)
+			((gc_compact *)b->owner)->marked = 1;
+		return;
+	}
+	grow_stack(&w->local, w->local.sz + 1);
+	PREFETCH(clos);
+	w->local.items[w->local.sz++] = clos;
+	if(w->local.sz > w->peak)
+		w->peak = w->local.sz;
+}
+
+/* The worker that does serial marking */
+static gc_worker *serial_worker(void)
+{
+	if(!gc_workers) {
+		gc_workers = allocate_arr(gc_worker, 1);
+		memset(gc_workers, 0, sizeof(gc_worker));
+		pthread_mutex_init(&gc_workers[0].lock, NULL);
+		gc_nworkers = 1;
+	}
+	return &gc_workers[0];
+}
+
+/* Set a mark bit, returning whether it wasn't set before */
+static int try_mark(unsigned char *byte, unsigned char bit)
+{
+	if(*byte & bit)
+		return 0;
+	if(gc_parallel)
+		return !(ATOMIC_OR(byte, bit) & bit);
+	*byte |= bit;
+	return 1;
+}
+
+#define closure_marked(clos) (*BLOCK_MARK_BYTE(clos) & BLOCK_MARK_BIT(clos))
+
+/* Push everything a closure refers to, or only what hasn't been marked yet.
+ * That leaves out whatever was allocated during an incremental marking.
+ */
+static void push_children(gc_worker *w, closure *clos, int unmarked)
+{
+	closure **payload;
+	arity i, cnt;
 	switch(clos->tag) {
 	case CLOSURE_NULL:
 		ASSERT(clos->gc & GC_USED);
-		return 0;
+		return;
 	case CLOSURE_PRIM:
-		return 0;
+	case CLOSURE_BLACKHOLE:
+		return;
+	case CLOSURE_IND:
+		payload = &clos->u.ind;
+		cnt = 1;
+		break;
 	case CLOSURE_CONSTR:
-		if(clos->u.constr.fields) {
-			closure **ptr;
-			for(ptr = clos->u.constr.fields; *ptr; ++ptr)
-				walk_closure(*ptr);
-		}
-		return 0;
+		payload = CLOSURE_FIELDS(clos);
+		cnt = clos->u.constr.nfields;
+		break;
 	case CLOSURE_THUNK:
-		if(clos->u.thunk.env) {
-			closure **ptr;
-			for(ptr = clos->u.thunk.env; *ptr; ++ptr)
-				walk_closure(*ptr);
-		}
-		return walk_entry(clos->u.thunk.entry);
+		payload = CLOSURE_ENV(clos);
+		cnt = clos->u.thunk.nenv;
+		break;
 	default:
 		panic("Unknown closure type %d", (int)clos->tag);
+		return;
+	}
+	/* Push in reverse so that the first field is scanned first */
+	for(i = cnt; i-- > 0; )
+		if(!unmarked || !closure_marked(UNTAG(payload[i])))
+			push_closure(w, payload[i]);
+}
+
+/* Blocks from *gc_sweep_next to the end of the list still have to be swept
+ * after a major collection. The allocator sweeps them as it runs out of free
+ * closures, and whatever is left gets swept before the next collection starts.
+ * New blocks go to the front of the list and are never swept by mistake.
+ * Minor collections sweep right away, since closures they free may be reused
+ * before the block holding them would be swept.
+ */
+static block **gc_sweep_next = NULL;
+
+void gc_write_barrier(closure *clos)
+{
+	clos = UNTAG(clos);
+	/* Deletion barrier: whatever the closure referred to at the start of the
+	 * marking must still get marked, otherwise it might be lost when its only
+	 * remaining reference is moved into an already scanned closure.
+	 */
+	if(gc_marking) {
+		gc_worker *w = serial_worker();
+		size_t sz = w->local.sz;
+		push_children(w, clos, 1);
+		gc_barrier_pushed += w->local.sz - sz;
+	}
+	/* A survivor of the last major collection only gets promoted once its
+	 * block is swept, and may be overwritten before that
+	 */
+	if(!(clos->gc & GC_OLD) && gc_sweep_next && closure_marked(clos))
+		clos->gc |= GC_OLD;
+	if((clos->gc & (GC_OLD | GC_REMEMBERED)) != GC_OLD)
+		return;
+	clos->gc |= GC_REMEMBERED;
+	if(gc_remembered_sz == gc_remembered_cap) {
+		gc_remembered_cap = gc_remembered_cap ? 2 * gc_remembered_cap : 0x100;
+		gc_remembered = reallocate_arr(closure *, gc_remembered,
+			gc_remembered_cap);
+	}
+	gc_remembered[gc_remembered_sz++] = clos;
+}
+
+/* Entry that evaluates a thunk to the first closure in its environment, given
+ * to the selector thunks the collector shortens
+ */
+static entry *gc_select_first = NULL;
+
+/* If a thunk does nothing but select a closure out of its environment, maybe
+ * through a case over a constructor that's been evaluated already, return the
+ * closure.
+ */
+static closure *selectee(closure *clos)
+{
+	entry *ent = clos->u.thunk.entry;
+	closure **env = CLOSURE_ENV(clos), *scrut;
+	arity len = clos->u.thunk.nenv;
+	masked_entry *branch;
+	switch(ent->tag) {
+	case ENTRY_SELECT:
+		return ent->u.select_idx < len ? deref(env[ent->u.select_idx]) : NULL;
+	case ENTRY_CASE:
+		if(ent->u.caseof.scrutinee.entry->tag != ENTRY_SELECT)
+			return NULL;
+		scrut = masked_var(ent->u.caseof.scrutinee.mask,
+			ent->u.caseof.scrutinee.entry->u.select_idx, env, len, NULL, 0);
+		if(!scrut)
+			return NULL;
+		scrut = deref(scrut);
+		if(scrut->tag != CLOSURE_CONSTR || scrut->u.constr.want_arity)
+			return NULL;
+		branch = &ent->u.caseof.branches[scrut->u.constr.var];
+		if(branch->entry->tag != ENTRY_SELECT)
+			return NULL;
+		scrut = masked_var(branch->mask, branch->entry->u.select_idx, env, len,
+			CLOSURE_FIELDS(scrut), scrut->u.constr.nfields);
+		return scrut ? deref(scrut) : NULL;
+	default:
+		return NULL;
+	}
+}
+
+/* Make a selector thunk keep alive only the closure it selects. If that's in
+ * WHNF, rather than being evaluated, turn the thunk into an indirection to it
+ * right away, as long as no other thread might be looking at it. Thunks being
+ * evaluated are left alone, and so is everything during incremental marking,
+ * which has to keep whatever was reachable when it started.
+ */
+static void shortcut_selector(gc_worker *w, closure *clos)
+{
+	closure *tgt;
+	if(clos->u.thunk.want_arity || clos->gc & GC_USED || gc_marking
+		|| !clos->size || clos->u.thunk.nenv > clos->size)
+		return;
+	tgt = selectee(clos);
+	if(!tgt || tgt == clos)
+		return;
+	if(!gc_parallel && (tgt->tag == CLOSURE_PRIM || tgt->tag == CLOSURE_CONSTR
+		|| (tgt->tag == CLOSURE_THUNK && tgt->u.thunk.want_arity))) {
+		/* The environment is inline, so there's nothing to erase */
+		clos->tag = CLOSURE_IND;
+		clos->u.ind = tgt;
+	} else if(clos->u.thunk.entry != gc_select_first) {
+		CLOSURE_PAYLOAD(clos)[0] = tgt;
+		clos->u.thunk.nenv = 1;
+		clos->u.thunk.entry = gc_select_first;
+	} else {
+		return;
+	}
+	++w->shortcuts;
+}
+
+static void sweep_regions(void);
+static void init_statics(void);
+static closure *static_instance(closure *);
+
+/* Point the payload of a closure past any indirections it refers to, so that
+ * nothing keeps the indirections alive, and tag the pointers to closures in
+ * WHNF, switching to static closures where there are some. Not done during
+ * incremental marking, for the same reason as shortcut_selector.
+ */
+static void tidy_payload(closure *clos)
+{
+	closure **payload;
+	arity i, cnt;
+	switch(clos->tag) {
+	case CLOSURE_CONSTR:
+		payload = CLOSURE_FIELDS(clos);
+		cnt = clos->u.constr.nfields;
+		break;
+	case CLOSURE_THUNK:
+		payload = CLOSURE_ENV(clos);
+		cnt = clos->u.thunk.nenv;
+		break;
+	default:
+		return;
+	}
+	for(i = 0; i < cnt; ++i)
+		if(!PTR_TAG(payload[i])) {
+			closure *val = tag_pointer(payload[i]), *shared;
+			if(PTR_TAG(val) && (shared = static_instance(UNTAG(val))))
+				val = tag_pointer(shared);
+			payload[i] = val;
+		}
+}
+
+static void scan_closure(gc_worker *w, closure *clos)
+{
+	ASSERT(clos);
+	ASSERT(!(clos->gc & GC_DEAD));
+	/* Old closures are considered live during a minor collection */
+	if(gc_minor && clos->gc & GC_OLD) return;
+	if(!try_mark(BLOCK_MARK_BYTE(clos), BLOCK_MARK_BIT(clos))) return;
+	++w->marked;
+	if(clos->tag == CLOSURE_THUNK)
+		shortcut_selector(w, clos);
+	if(!gc_marking)
+		tidy_payload(clos);
+	push_children(w, clos, 0);
+}
+
+/* Scan objects on the serial mark stack until it's empty or budget objects
+ * have been popped. Returns whether the stack is empty. A budget of 0 means no
+ * limit.
+ */
+static int mark(size_t budget)
+{
+	gc_worker *w = serial_worker();
+	size_t done = 0;
+	while(w->local.sz) {
+		if(budget && done++ == budget)
+			return 0;
+		scan_closure(w, w->local.items[--w->local.sz]);
+	}
+	return 1;
+}
+
+/* Move the bottom half of a worker's stack, the objects it would get to last,
+ * over to its shared stack.
+ */
+static void share_work(gc_worker *w)
+{
+	size_t half = w->local.sz / 2;
+	pthread_mutex_lock(&w->lock);
+	grow_stack(&w->shared, w->shared.sz + half);
+	memcpy(w->shared.items + w->shared.sz, w->local.items,
+		half * sizeof(closure *));
+	w->shared.sz += half;
+	pthread_mutex_unlock(&w->lock);
+	w->local.sz -= half;
+	memmove(w->local.items, w->local.items + half,
+		w->local.sz * sizeof(closure *));
+}
+
+/* Take half of the shared stack of victim onto the stack of w */
+static int steal_from(gc_worker *w, gc_worker *victim)
+{
+	size_t take;
+	if(!victim->shared.sz)
 		return 0;
+	pthread_mutex_lock(&victim->lock);
+	take = (victim->shared.sz + 1) / 2;
+	if(take) {
+		victim->shared.sz -= take;
+		grow_stack(&w->local, w->local.sz + take);
+		memcpy(w->local.items + w->local.sz,
+			victim->shared.items + victim->shared.sz, take * sizeof(closure *));
+		w->local.sz += take;
+	}
+	pthread_mutex_unlock(&victim->lock);
+	if(take && victim != w)
+		++w->steals;
+	return take != 0;
+}
+
+/* Look for work, starting with our own shared stack */
+static int steal(gc_worker *w)
+{
+	size_t self = w - gc_workers, i;
+	for(i = 0; i < gc_nworkers; ++i)
+		if(steal_from(w, &gc_workers[(self + i) % gc_nworkers]))
+			return 1;
+	return 0;
+}
+
+/* Mark until every worker is out of work. A worker only goes idle once its
+ * shared stack is empty, and idle workers don't produce work, so once all of
+ * them are idle there's nothing left to steal.
+ */
+static void mark_parallel_worker(gc_worker *w)
+{
+	for(;;) {
+		while(w->local.sz) {
+			scan_closure(w, w->local.items[--w->local.sz]);
+			if(gc_idle && w->local.sz > 1 && !w->shared.sz)
+				share_work(w);
+		}
+		if(steal(w))
+			continue;
+		ATOMIC_ADD(&gc_idle, 1);
+		for(;;) {
+			size_t i;
+			/* Only a hint, stealing looks again under the lock */
+			for(i = 0; i < gc_nworkers; ++i)
+				if(gc_workers[i].shared.sz)
+					break;
+			if(i < gc_nworkers) {
+				ATOMIC_SUB(&gc_idle, 1);
+				if(steal(w))
+					break;
+				ATOMIC_ADD(&gc_idle, 1);
+			} else if(ATOMIC_ADD(&gc_idle, 0) == gc_nworkers) {
+				return;
+			}
+			sched_yield();
+		}
 	}
 }
 
+static void *mark_thread(void *arg)
+{
+	mark_parallel_worker((gc_worker *)arg);
+	return NULL;
+}
+
+/* Drain the serial mark stack, with the help of more threads if asked to */
+static void mark_all(void)
+{
+	pthread_t *threads;
+	size_t i, n = rts_opts.gc_threads;
+	serial_worker();
+#ifndef __GNUC__
+	n = 1;
+#endif
+	if(n <= 1) {
+		mark(0);
+		return;
+	}
+	if(gc_nworkers < n) {
+		gc_workers = reallocate_arr(gc_worker, gc_workers, n);
+		memset(gc_workers + gc_nworkers, 0,
+			(n - gc_nworkers) * sizeof(gc_worker));
+		for(i = gc_nworkers; i < n; ++i)
+			pthread_mutex_init(&gc_workers[i].lock, NULL);
+		gc_nworkers = n;
+	}
+	gc_parallel = 1;
+	gc_idle = 0;
+	threads = allocate_arr(pthread_t, n);
+	for(i = 1; i < n; ++i)
+		if(pthread_create(&threads[i], NULL, mark_thread, &gc_workers[i]))
+			panic_errno("Could not start a marking thread");
+	mark_parallel_worker(&gc_workers[0]);
+	for(i = 1; i < n; ++i)
+		pthread_join(threads[i], NULL);
+	unallocate(threads);
+	gc_parallel = 0;
+}
+
+/* Move the per-worker counters over to the statistics */
+static void collect_worker_stats(void)
+{
+	size_t i;
+	for(i = 0; i < gc_nworkers; ++i) {
+		gc_worker *w = &gc_workers[i];
+		gc_stats.marked += w->marked;
+		gc_stats.steals += w->steals;
+		gc_stats.shortcuts += w->shortcuts;
+		if(w->peak > gc_stats.peak_mark_stack)
+			gc_stats.peak_mark_stack = w->peak;
+		w->marked = w->steals = w->shortcuts = w->peak = 0;
+	}
+}
+
+static void record_pause(double start)
+{
+	double pause = gc_time() - start;
+	if(pause > gc_stats.max_pause)
+		gc_stats.max_pause = pause;
+}
+
+void gc_print_stats(FILE *out)
+{
+	double secs = gc_stats.mark_time;
+	struct rusage usage;
+	fprintf(out, "%lu collections (%lu minor)\n",
+		(long unsigned)gc_stats.collections,
+		(long unsigned)gc_stats.minor_collections);
+	fprintf(out, "%lu objects marked in %.3fs", (long unsigned)gc_stats.marked,
+		secs);
+	if(secs > 0)
+		fprintf(out, " (%.0f objects/sec)", gc_stats.marked / secs);
+	fprintf(out, "\n");
+	fprintf(out, "%lu peak mark stack entries (%lu bytes)\n",
+		(long unsigned)gc_stats.peak_mark_stack,
+		(long unsigned)(gc_stats.peak_mark_stack * sizeof(void *)));
+	fprintf(out, "%lu incremental mark slices\n",
+		(long unsigned)gc_stats.slices);
+	fprintf(out, "%lu selector thunks shortened\n",
+		(long unsigned)gc_stats.shortcuts);
+	fprintf(out, "%lu blocks swept lazily\n",
+		(long unsigned)gc_stats.lazy_swept);
+	fprintf(out, "%lu compactions, %lu bytes moved\n",
+		(long unsigned)gc_stats.compactions,
+		(long unsigned)gc_stats.compacted_bytes);
+	fprintf(out, "%lu KiB of blocks returned to the system\n",
+		(long unsigned)(block_release_count * (BLOCK_SIZE / 1024)));
+	fprintf(out, "%lu closures on the scratch stack\n",
+		(long unsigned)gc_stats.scratch);
+	fprintf(out, "%lu static entries\n", (long unsigned)gc_entry_count);
+	fprintf(out, "%lu bytes in compact regions\n",
+		(long unsigned)gc_compact_bytes);
+	fprintf(out, "%lu large objects, %lu bytes peak, %lu bytes live\n",
+		(long unsigned)gc_stats.large_objects,
+		(long unsigned)gc_stats.peak_large_bytes,
+		(long unsigned)gc_large_bytes);
+	fprintf(out, "%lu bytes peak heap, %lu bytes live\n",
+		(long unsigned)gc_stats.peak_bytes, (long unsigned)last_collection);
+	if(rts_opts.gc_threads > 1)
+		fprintf(out, "%lu marking threads, %lu steals\n",
+			(long unsigned)rts_opts.gc_threads,
+			(long unsigned)gc_stats.steals);
+	fprintf(out, "%.3fs max pause\n", gc_stats.max_pause);
+	if(!getrusage(RUSAGE_SELF, &usage))
+		fprintf(out, "%lu KiB max RSS\n", (long unsigned)usage.ru_maxrss);
+}
+
+void gc_add_payload(size_t bytes)
+{
+	gc_used_bytes += bytes;
+	gc_allocated += bytes;
+}
+
+void gc_remove_payload(size_t bytes)
+{
+	gc_used_bytes -= bytes < gc_used_bytes ? bytes : gc_used_bytes;
+}
+
+static int large_object(size_t bytes)
+{
+	return rts_opts.large_object_min && bytes >= rts_opts.large_object_min;
+}
+
+/* Out-of-line primitive data is preceded by the number of primitives sharing
+ * it. It's accounted for only once.
+ */
+typedef union prim_header {
+	size_t refs;
+	/* For alignment */
+	void *p;
+	long l;
+	double d;
+} prim_header;
+
+void *gc_alloc_prim_data(size_t bytes)
+{
+	prim_header *hdr;
+	gc_add_payload(bytes);
+	if(!large_object(bytes))
+		hdr = do_alloc(sizeof(prim_header) + bytes);
+	else {
+		gc_large_bytes += bytes;
+		if(gc_large_bytes > gc_stats.peak_large_bytes)
+			gc_stats.peak_large_bytes = gc_large_bytes;
+		++gc_stats.large_objects;
+		hdr = alloc_large(sizeof(prim_header) + bytes);
+	}
+	hdr->refs = 1;
+	return hdr + 1;
+}
+
+void gc_free_prim_data(void *data, size_t bytes)
+{
+	prim_header *hdr = (prim_header *)data - 1;
+	if(--hdr->refs)
+		return;
+	gc_remove_payload(bytes);
+	if(!large_object(bytes)) {
+		unallocate(hdr);
+		return;
+	}
+	gc_large_bytes -= bytes;
+	free_large(hdr, sizeof(prim_header) + bytes);
+}
+
+void *gc_share_prim_data(closure *clos)
+{
+	void *data;
+	clos = UNTAG(clos);
+	if(!(BLOCK_OF(clos)->flags & BLOCK_COMPACT)) {
+		++((prim_header *)clos->u.prim.data.ptr - 1)->refs;
+		return clos->u.prim.data.ptr;
+	}
+	data = gc_alloc_prim_data(clos->u.prim.size);
+	memcpy(data, clos->u.prim.data.ptr, clos->u.prim.size);
+	return data;
+}
+
+void *gc_unshare_prim_data(closure *clos)
+{
+	prim_header *hdr;
+	void *data;
+	clos = UNTAG(clos);
+	ASSERT(!(BLOCK_OF(clos)->flags & BLOCK_COMPACT));
+	hdr = (prim_header *)clos->u.prim.data.ptr - 1;
+	if(hdr->refs == 1)
+		return clos->u.prim.data.ptr;
+	--hdr->refs;
+	data = gc_alloc_prim_data(clos->u.prim.size);
+	memcpy(data, clos->u.prim.data.ptr, clos->u.prim.size);
+	return clos->u.prim.data.ptr = data;
+}
+
+/* Bytes used by objects that have survived a collection */
+static size_t old_bytes(void)
+{
+	return gc_used_bytes > gc_allocated ? gc_used_bytes - gc_allocated : 0;
+}
+
+/* The memory itself stays in its block and goes onto the free list */
 static void free_closure(closure *clos)
 {
 	erase_closure(clos);
+	gc_used_bytes -= CLOSURE_BYTES(clos->size);
+	clos->tag = CLOSURE_NULL;
 	clos->gc = ~0;
-	unallocate(clos);
 }
 
-static void free_entry(entry *ent)
+/* Walk a block linearly, freeing closures that weren't marked and promoting
+ * the ones that were, then clear its bitmap. A major collection rebuilds the
+ * free lists from scratch, while a minor one only adds the closures it frees
+ * and leaves old closures alone. Returns the number of closures left alive in
+ * the block.
+ */
+static size_t sweep_block(block *b)
 {
-	erase_entry(ent);
-	ent->gc = ~0;
-	unallocate(ent);
+	char *ptr;
+	size_t live = 0;
+	for(ptr = BLOCK_START(b); ptr < b->free;
+		ptr += CLOSURE_BYTES(((closure *)ptr)->size)) {
+		closure *clos = (closure *)ptr;
+		if(clos->gc & GC_DEAD) {
+			if(gc_minor)
+				continue;
+		} else if(gc_minor && clos->gc & GC_OLD) {
+			++live;
+			continue;
+		} else if(closure_marked(clos)) {
+			if(!(clos->gc & GC_OLD))
+				clos->gc |= GC_OLD;
+			++live;
+			continue;
+		} else {
+			free_closure(clos);
+			--gc_closure_count;
+		}
+		clos->u.next_free = gc_free_closures[clos->size];
+		gc_free_closures[clos->size] = clos;
+	}
+	b->flags &= ~BLOCK_YOUNG;
+	memset(b->marks, 0, sizeof(b->marks));
+	return live;
 }
 
-void gc_collect()
+/* Drop the free list entries pointing into a block that is about to be reset
+ * or released. They were pushed last, so they're at the heads of the lists.
+ */
+static void unlink_block_free(block *b)
 {
-	ptr_list *plst, lst;
-	/* Mark */
-	for(lst = gc_closure_list; lst; lst = lst->next)
-		if(((closure *)lst->ptr)->gc & GC_REFERRED)
-			walk_closure((closure *)lst->ptr);
-	/* Sweep */
-	for(plst = &gc_closure_list; *plst; )
-		if(((closure *)(*plst)->ptr)->gc & GC_SEEN) {
-			((closure *)(*plst)->ptr)->gc &= ~GC_SEEN;
-			plst = &(*plst)->next;
+	arity size;
+	for(size = 0; size <= CLOSURE_MAX_INLINE; ++size)
+		while(gc_free_closures[size]
+			&& (char *)gc_free_closures[size] >= BLOCK_START(b)
+			&& (char *)gc_free_closures[size] < b->free)
+			gc_free_closures[size] = gc_free_closures[size]->u.next_free;
+}
+
+/* Innermost evaluation frame */
+static gc_frame *gc_frames = NULL;
+
+void gc_push_frame(gc_frame *frame, closure *self, closure **env, size_t len)
+{
+	frame->prev = gc_frames;
+	frame->self = self;
+	frame->env = env;
+	frame->len = len;
+	gc_frames = frame;
+}
+
+void gc_pop_frame(gc_frame *frame)
+{
+	ASSERT(gc_frames == frame);
+	gc_frames = frame->prev;
+}
+
+static gc_roots *gc_registered = NULL;
+
+void gc_push_roots(gc_roots *roots, closure **slots, size_t len)
+{
+	roots->prev = gc_registered;
+	roots->slots = slots;
+	roots->len = len;
+	gc_registered = roots;
+}
+
+void gc_pop_roots(gc_roots *roots)
+{
+	ASSERT(gc_registered == roots);
+	gc_registered = roots->prev;
+}
+
+/* Blackhole the thunk of a frame, if that hasn't been done eagerly */
+static void blackhole_frame(gc_frame *frame)
+{
+	closure *self = frame->self;
+	if(self->tag == CLOSURE_THUNK && !self->u.thunk.want_arity)
+		self->tag = CLOSURE_BLACKHOLE;
+}
+
+/* Push what evaluations still need, blackholing their thunks. The environment
+ * stays in place and the frame keeps alive whatever is still needed of it.
+ */
+static void mark_frames(gc_worker *w)
+{
+	gc_frame *frame;
+	size_t i;
+	for(frame = gc_frames; frame; frame = frame->prev) {
+		blackhole_frame(frame);
+		push_closure(w, frame->self);
+		for(i = 0; i < frame->len; ++i)
+			push_closure(w, frame->env[i]);
+	}
+}
+
+/* Push the closures that are being referred to from outside of the heap */
+static void mark_roots(void)
+{
+	gc_worker *w = serial_worker();
+	gc_roots *roots;
+	block *b;
+	char *ptr;
+	size_t i;
+	if(!gc_select_first) {
+		gc_select_first = new_entry(ENTRY_SELECT);
+		gc_select_first->u.select_idx = 0;
+	}
+	if(!gc_minor) {
+		gc_compact *r;
+		for(r = gc_regions; r; r = r->next)
+			r->marked = 0;
+	}
+	/* Marking threads mustn't race to create them */
+	init_statics();
+	prune_roots(&gc_pins);
+	prune_roots(&gc_uses);
+	for(i = 0; i < gc_pins.sz; ++i)
+		push_closure(w, gc_pins.items[i]);
+	for(i = 0; i < gc_uses.sz; ++i)
+		push_closure(w, gc_uses.items[i]);
+	for(roots = gc_registered; roots; roots = roots->prev)
+		for(i = 0; i < roots->len; ++i)
+			if(roots->slots[i])
+				push_closure(w, roots->slots[i]);
+	for(b = gc_scratch; b; b = b->next)
+		for(ptr = BLOCK_START(b); ptr < b->free;
+			ptr += CLOSURE_BYTES(((closure *)ptr)->size))
+			push_children(w, (closure *)ptr, 0);
+	/* Old closures that might point into the young generation */
+	if(gc_minor)
+		for(i = 0; i < gc_remembered_sz; ++i)
+			push_children(w, gc_remembered[i], 0);
+	/* Closures referred to by older entries have been promoted already */
+	for(i = gc_minor ? gc_old_refs : 0; i < gc_entry_refs_sz; ++i)
+		if(gc_entry_refs[i]->u.ref)
+			push_closure(w, gc_entry_refs[i]->u.ref);
+	mark_frames(w);
+}
+
+/* Sweep the block *pblk points to, releasing it if nothing in it survived.
+ * Returns the link to the block after it.
+ */
+static block **sweep_one(block **pblk)
+{
+	block *b = *pblk;
+	if(gc_minor && !(b->flags & BLOCK_YOUNG))
+		return &b->next;
+	if(sweep_block(b) || gc_minor)
+		return &b->next;
+	unlink_block_free(b);
+	if(b == gc_blocks) {
+		/* Keep the block we're bumping into, just rewind it */
+		b->free = BLOCK_START(b);
+		return &b->next;
+	}
+	*pblk = b->next;
+	free_block(b);
+	return pblk;
+}
+
+static void done_sweeping(void)
+{
+	gc_sweep_next = NULL;
+	last_collection = old_bytes();
+}
+
+/* Sweep pending blocks until there's a free closure of the given size */
+static void sweep_for(arity size)
+{
+	while(*gc_sweep_next && !gc_free_closures[size]) {
+		gc_sweep_next = sweep_one(gc_sweep_next);
+		++gc_stats.lazy_swept;
+	}
+	if(!*gc_sweep_next)
+		done_sweeping();
+}
+
+static void finish_sweep(void)
+{
+	if(gc_sweep_next) {
+		while(*gc_sweep_next)
+			gc_sweep_next = sweep_one(gc_sweep_next);
+		done_sweeping();
+	}
+}
+
+/* Where the marked closures of a block are moved to by a compaction: the new
+ * address of each of them, in order, and the number of them that come before
+ * each byte of the mark bitmap
+ */
+typedef struct block_forward {
+	unsigned short before[BLOCK_MARK_BYTES];
+	closure **to;
+} block_forward;
+
+static unsigned count_bits(unsigned char byte)
+{
+	unsigned cnt = 0;
+	for(; byte; byte &= byte - 1)
+		++cnt;
+	return cnt;
+}
+
+/* The address a pointer, possibly tagged, will have after a compaction */
+static closure *forward(closure *ptr)
+{
+	closure *clos = UNTAG(ptr);
+	block *b = BLOCK_OF(clos);
+	block_forward *fw = b->forward;
+	size_t byte;
+	if(!fw)
+		return ptr;
+	byte = BLOCK_MARK_BYTE(clos) - b->marks;
+	return (closure *)((size_t)fw->to[fw->before[byte]
+		+ count_bits(b->marks[byte] & (BLOCK_MARK_BIT(clos) - 1))]
+		| PTR_TAG(ptr));
+}
+
+/* The environment of a blackhole is left to the frame evaluating it */
+static void forward_payload(closure *clos)
+{
+	closure **payload;
+	arity i, cnt;
+	switch(clos->tag) {
+	case CLOSURE_IND:
+		clos->u.ind = forward(clos->u.ind);
+		return;
+	case CLOSURE_CONSTR:
+		payload = CLOSURE_FIELDS(clos);
+		cnt = clos->u.constr.nfields;
+		break;
+	case CLOSURE_THUNK:
+		payload = CLOSURE_ENV(clos);
+		cnt = clos->u.thunk.nenv;
+		break;
+	default:
+		return;
+	}
+	for(i = 0; i < cnt; ++i)
+		payload[i] = forward(payload[i]);
+}
+
+/* A compaction in progress. Closures referred to from outside the heap stay
+ * where they are, and split the blocks into segments that everything else is
+ * slid into, in order. A closure is never moved past the end of its own
+ * segment, and a hole left at the end of a segment is never too small for a
+ * free closure.
+ */
+typedef struct compactor {
+	block **blocks;
+	/* The block being moved into, where to, and where it ends up */
+	size_t dest;
+	char *to;
+	char **ends;
+	/* The closure ending the current segment, NULL if the block does, and
+	 * where to look for the one after it
+	 */
+	closure *pinned;
+	char *scan;
+	/* Pairs of start and end of holes left in front of pinned closures */
+	char **holes;
+	size_t holes_sz;
+	size_t holes_cap;
+} compactor;
+
+/* The evaluator holds onto the thunks of its frames directly */
+static int stays(closure *clos)
+{
+	return closure_marked(clos) && clos->gc & (GC_REFERRED | GC_FRAMED);
+}
+
+static void find_pinned(compactor *c)
+{
+	block *b = c->blocks[c->dest];
+	c->pinned = NULL;
+	while(c->scan < b->free) {
+		closure *clos = (closure *)c->scan;
+		c->scan += CLOSURE_BYTES(clos->size);
+		if(stays(clos)) {
+			c->pinned = clos;
+			return;
+		}
+	}
+}
+
+/* Move the destination on to the next segment */
+static void next_segment(compactor *c, size_t n)
+{
+	if(c->pinned) {
+		if((char *)c->pinned > c->to) {
+			if(c->holes_sz + 2 > c->holes_cap) {
+				c->holes_cap = c->holes_cap ? 2 * c->holes_cap : 0x100;
+				c->holes = reallocate_arr(char *, c->holes, c->holes_cap);
+			}
+			c->holes[c->holes_sz++] = c->to;
+			c->holes[c->holes_sz++] = (char *)c->pinned;
+		}
+		c->to = (char *)c->pinned + CLOSURE_BYTES(c->pinned->size);
+	} else {
+		c->ends[c->dest] = c->to;
+		ASSERT(c->dest + 1 < n);
+		c->to = c->scan = BLOCK_START(c->blocks[++c->dest]);
+	}
+	find_pinned(c);
+}
+
+/* Where a closure that can move goes */
+static closure *place(compactor *c, size_t n, closure *clos)
+{
+	size_t bytes = CLOSURE_BYTES(clos->size);
+	for(;;) {
+		char *limit = c->pinned ? (char *)c->pinned
+			: BLOCK_END(c->blocks[c->dest]);
+		if(c->to + bytes <= limit && (!c->pinned || c->to + bytes == limit
+			|| c->to + bytes + CLOSURE_BYTES(0) <= limit)) {
+			closure *at = (closure *)c->to;
+			ASSERT(BLOCK_OF(at) != BLOCK_OF(clos) || at <= clos);
+			c->to += bytes;
+			return at;
+		}
+		next_segment(c, n);
+	}
+}
+
+/* Turn a hole into free closures */
+static void fill_hole(char *start, char *end)
+{
+	while(start < end) {
+		closure *clos = (closure *)start;
+		size_t bytes = CLOSURE_BYTES(CLOSURE_MAX_INLINE);
+		if((size_t)(end - start) <= bytes)
+			bytes = end - start;
+		else if((size_t)(end - start) - bytes < CLOSURE_BYTES(0))
+			bytes = end - start - CLOSURE_BYTES(0);
+		clos->tag = CLOSURE_NULL;
+		clos->gc = ~0;
+		clos->size = (bytes - sizeof(closure)) / sizeof(closure *);
+		clos->u.next_free = gc_free_closures[clos->size];
+		gc_free_closures[clos->size] = clos;
+		start += bytes;
+	}
+}
+
+/* Slide the marked closures of the heap together in allocation order, if
+ * enough of it is free, and release the blocks that end up empty. Returns
+ * whether the heap was compacted.
+ */
+static int compact_heap(void)
+{
+	compactor c;
+	block *b;
+	char *ptr;
+	size_t n = 0, i, k, last, live = 0;
+	gc_frame *frame;
+	gc_roots *roots;
+	for(b = gc_blocks; b; b = b->next)
+		++n;
+	if(!n)
+		return 0;
+	for(b = gc_blocks; b; b = b->next)
+		for(ptr = BLOCK_START(b); ptr < b->free;
+			ptr += CLOSURE_BYTES(((closure *)ptr)->size))
+			if(closure_marked((closure *)ptr))
+				live += CLOSURE_BYTES(((closure *)ptr)->size);
+	if(live > n * (BLOCK_SIZE - sizeof(block))
+		* (1 - rts_opts.compact_threshold))
+		return 0;
+	/* Whatever isn't listed anymore may move */
+	prune_roots(&gc_pins);
+	prune_roots(&gc_uses);
+	/* Frames pushed during an incremental marking haven't been blackholed
+	 * yet. Their environments may be their thunks', which only the frames
+	 * get to forward.
+	 */
+	for(frame = gc_frames; frame; frame = frame->prev) {
+		blackhole_frame(frame);
+		frame->self->gc |= GC_FRAMED;
+	}
+	/* Oldest first */
+	c.blocks = allocate_arr(block *, n);
+	for(b = gc_blocks, i = n; b; b = b->next)
+		c.blocks[--i] = b;
+	c.ends = allocate_arr(char *, n);
+	c.holes = NULL;
+	c.holes_sz = c.holes_cap = 0;
+	c.dest = 0;
+	c.to = c.scan = BLOCK_START(c.blocks[0]);
+	find_pinned(&c);
+	/* Work out where everything goes, freeing what's dead on the way */
+	for(i = 0; i < n; ++i) {
+		block_forward *fw = allocate(block_forward);
+		size_t cnt = 0;
+		b = c.blocks[i];
+		for(k = 0; k < BLOCK_MARK_BYTES; ++k) {
+			fw->before[k] = cnt;
+			cnt += count_bits(b->marks[k]);
+		}
+		fw->to = allocate_arr(closure *, cnt);
+		k = 0;
+		for(ptr = BLOCK_START(b); ptr < b->free;
+			ptr += CLOSURE_BYTES(((closure *)ptr)->size)) {
+			closure *clos = (closure *)ptr;
+			if(closure_marked(clos))
+				fw->to[k++] = stays(clos) ? clos : place(&c, n, clos);
+			else if(!(clos->gc & GC_DEAD)) {
+				free_closure(clos);
+				--gc_closure_count;
+			}
+		}
+		b->forward = fw;
+	}
+	/* Whatever's past the last closure moved only keeps the pinned ones */
+	last = c.dest;
+	while(c.pinned || c.dest + 1 < n)
+		next_segment(&c, n);
+	c.ends[c.dest] = c.to;
+	/* Update every reference into the heap, while everything's still in place
+	 */
+	for(i = 0; i < n; ++i)
+		for(ptr = BLOCK_START(c.blocks[i]); ptr < c.blocks[i]->free;
+			ptr += CLOSURE_BYTES(((closure *)ptr)->size))
+			if(closure_marked((closure *)ptr))
+				forward_payload((closure *)ptr);
+	for(b = gc_scratch; b; b = b->next)
+		for(ptr = BLOCK_START(b); ptr < b->free;
+			ptr += CLOSURE_BYTES(((closure *)ptr)->size))
+			forward_payload((closure *)ptr);
+	for(i = 0; i < gc_entry_refs_sz; ++i)
+		if(gc_entry_refs[i]->u.ref)
+			gc_entry_refs[i]->u.ref = forward(gc_entry_refs[i]->u.ref);
+	for(frame = gc_frames; frame; frame = frame->prev)
+		for(k = 0; k < frame->len; ++k)
+			frame->env[k] = forward(frame->env[k]);
+	for(roots = gc_registered; roots; roots = roots->prev)
+		for(k = 0; k < roots->len; ++k)
+			if(roots->slots[k])
+				roots->slots[k] = forward(roots->slots[k]);
+	/* Slide. Nothing is moved over a closure that hasn't been moved yet. */
+	for(i = 0; i < n; ++i) {
+		block_forward *fw = c.blocks[i]->forward;
+		k = 0;
+		for(ptr = BLOCK_START(c.blocks[i]); ptr < c.blocks[i]->free; ) {
+			closure *clos = (closure *)ptr;
+			size_t bytes = CLOSURE_BYTES(clos->size);
+			ptr += bytes;
+			if(!closure_marked(clos))
+				continue;
+			if(fw->to[k] != clos) {
+				memmove(fw->to[k], clos, bytes);
+				gc_stats.compacted_bytes += bytes;
+			}
+			fw->to[k++]->gc |= GC_OLD;
+		}
+	}
+	for(i = 0; i < c.holes_sz; i += 2)
+		fill_hole(c.holes[i], c.holes[i + 1]);
+	for(frame = gc_frames; frame; frame = frame->prev)
+		frame->self->gc &= ~GC_FRAMED;
+	/* Rebuild the block list with the last block moved into at its head */
+	gc_blocks = NULL;
+	for(i = 0; i <= n; ++i) {
+		block_forward *fw;
+		if(i == last)
+			continue;
+		b = c.blocks[i < n ? i : last];
+		fw = b->forward;
+		unallocate(fw->to);
+		unallocate(fw);
+		b->forward = NULL;
+		b->free = c.ends[i < n ? i : last];
+		if(b->free == BLOCK_START(b)) {
+			free_block(b);
+			continue;
+		}
+		b->flags &= ~BLOCK_YOUNG;
+		memset(b->marks, 0, sizeof(b->marks));
+		b->next = gc_blocks;
+		gc_blocks = b;
+	}
+	++gc_stats.compactions;
+	unallocate(c.holes);
+	unallocate(c.ends);
+	unallocate(c.blocks);
+	return 1;
+}
+
+/* Sweep once marking is complete. Only the block being bumped into is swept
+ * after a major collection, the rest is left to the allocator, unless the
+ * heap gets compacted.
+ */
+static void sweep(int minor)
+{
+	block **pblk;
+	arity size;
+	size_t i;
+	/* Before anything moves */
+	for(i = 0; i < gc_remembered_sz; ++i)
+		gc_remembered[i]->gc &= ~GC_REMEMBERED;
+	gc_remembered_sz = 0;
+	if(minor) {
+		for(pblk = &gc_blocks; *pblk; )
+			pblk = sweep_one(pblk);
+	} else {
+		for(size = 0; size <= CLOSURE_MAX_INLINE; ++size)
+			gc_free_closures[size] = NULL;
+		sweep_regions();
+		if(rts_opts.compact_threshold > 0 && compact_heap()) {
+			/* Everything's been swept */
+			for(pblk = &gc_blocks; *pblk; pblk = &(*pblk)->next)
+				;
+			gc_sweep_next = pblk;
 		} else {
-			free_closure((closure *)(*plst)->ptr);
-			erase_list(plst);
-			--gc_closure_list_sz;
-		}
-	for(plst = &gc_entry_list; *plst; )
-		if(((entry *)(*plst)->ptr)->gc & GC_SEEN) {
-			((entry *)(*plst)->ptr)->gc &= ~GC_SEEN;
-			plst = &(*plst)->next;
+			gc_sweep_next = gc_blocks ? sweep_one(&gc_blocks) : &gc_blocks;
+		}
+	}
+	gc_old_refs = gc_entry_refs_sz;
+	gc_allocated = 0;
+	if(gc_sweep_next && !*gc_sweep_next)
+		done_sweeping();
+	if(!minor)
+		release_idle_blocks();
+}
+
+/* Run a whole collection without interruption */
+static void collect(int minor)
+{
+	double start = gc_time();
+	finish_sweep();
+	if(gc_used_bytes > gc_stats.peak_bytes)
+		gc_stats.peak_bytes = gc_used_bytes;
+	gc_minor = minor;
+	mark_roots();
+	mark_all();
+	collect_worker_stats();
+	++gc_stats.collections;
+	if(minor)
+		++gc_stats.minor_collections;
+	gc_stats.mark_time += gc_time() - start;
+	sweep(minor);
+	record_pause(start);
+}
+
+/* Do a slice of incremental marking, and sweep if that completes it */
+static void mark_slice(size_t budget)
+{
+	double start = gc_time();
+	int done = mark(budget);
+	collect_worker_stats();
+	++gc_stats.slices;
+	gc_stats.mark_time += gc_time() - start;
+	if(done) {
+		gc_marking = 0;
+		++gc_stats.collections;
+		sweep(0);
+	}
+	record_pause(start);
+}
+
+void gc_collect()
+{
+	if(gc_marking)
+		mark_slice(0);
+	else
+		collect(0);
+}
+
+/* How large the old generation may grow before a major collection */
+static size_t heap_target(void)
+{
+	double target = last_collection * rts_opts.heap_factor;
+	if(target < rts_opts.heap_min)
+		target = rts_opts.heap_min;
+	if(rts_opts.heap_max && target > rts_opts.heap_max)
+		target = rts_opts.heap_max;
+	return (size_t)target;
+}
+
+/* Collect everything that can be collected, and give up if the heap is still
+ * over the hard limit.
+ */
+static void enforce_heap_limit(void)
+{
+	if(gc_marking)
+		mark_slice(0);
+	else
+		collect(0);
+	finish_sweep();
+	if(gc_used_bytes > rts_opts.heap_limit)
+		panic("Heap exhausted: %lu bytes in use, the limit is %lu",
+			(long unsigned)gc_used_bytes, (long unsigned)rts_opts.heap_limit);
+}
+
+/* Run a collection once the nursery fills up. It's a major one if the old
+ * generation has outgrown its target size.
+ */
+static void maybe_collect(void)
+{
+	if(rts_opts.heap_limit && gc_used_bytes > rts_opts.heap_limit) {
+		enforce_heap_limit();
+	} else if(gc_marking) {
+		size_t bytes = gc_allocated - gc_slice_start;
+		if(gc_allocated - gc_mark_start > heap_target()) {
+			mark_slice(0);
+		} else if(bytes >= GC_SLICE_BYTES) {
+			size_t budget = rts_opts.gc_slice * (bytes / GC_SLICE_BYTES)
+				+ gc_barrier_pushed;
+			gc_slice_start = gc_allocated;
+			gc_barrier_pushed = 0;
+			mark_slice(budget);
+		}
+	} else if(gc_allocated > GC_NURSERY) {
+		finish_sweep();
+		if(old_bytes() <= heap_target()) {
+			collect(1);
+		} else if(rts_opts.gc_slice) {
+			double start = gc_time();
+			gc_minor = 0;
+			gc_marking = 1;
+			gc_mark_start = gc_slice_start = gc_allocated;
+			gc_barrier_pushed = 0;
+			mark_roots();
+			record_pause(start);
 		} else {
-			free_entry((entry *)(*plst)->ptr);
-			erase_list(plst);
-			--gc_entry_list_sz;
+			collect(0);
 		}
-	last_collection = gc_closure_list_sz + gc_entry_list_sz;
+	}
 }
 
-closure *new_closure(char tag)
+closure *new_closure(char tag, arity size)
 {
 	closure *clos;
-	if(gc_closure_list_sz + gc_entry_list_sz > 2 * last_collection)
-		gc_collect();
+	maybe_collect();
+
+	if(size > CLOSURE_MAX_INLINE)
+		size = CLOSURE_MAX_INLINE;
+	if(!gc_free_closures[size] && gc_sweep_next)
+		sweep_for(size);
+	if(gc_free_closures[size]) {
+		clos = gc_free_closures[size];
+		gc_free_closures[size] = clos->u.next_free;
+		BLOCK_OF(clos)->flags |= BLOCK_YOUNG;
+	} else {
+		if(!gc_blocks || gc_blocks->free + CLOSURE_BYTES(size)
+			> BLOCK_END(gc_blocks)) {
+			block *b = alloc_block();
+			b->next = gc_blocks;
+			gc_blocks = b;
+		}
+		clos = (closure *)gc_blocks->free;
+		gc_blocks->free += CLOSURE_BYTES(size);
+		gc_blocks->flags |= BLOCK_YOUNG;
+	}
+	clos->tag = tag;
+	clos->size = size;
+	clos->gc = GC_USED;
+	list_root(&gc_uses, clos);
+	if(gc_marking)
+		*BLOCK_MARK_BYTE(clos) |= BLOCK_MARK_BIT(clos);
+	++gc_closure_count;
+	gc_used_bytes += CLOSURE_BYTES(size);
+	gc_allocated += CLOSURE_BYTES(size);
+	return clos;
+}
 
-	clos = allocate(closure);
+closure *gc_push_scratch(char tag, arity size)
+{
+	closure *clos;
+	if(size > CLOSURE_MAX_INLINE)
+		size = CLOSURE_MAX_INLINE;
+	if(!gc_scratch || gc_scratch->free + CLOSURE_BYTES(size)
+		> BLOCK_END(gc_scratch)) {
+		block *b = gc_scratch_spare ? gc_scratch_spare : alloc_block();
+		gc_scratch_spare = NULL;
+		b->flags = BLOCK_SCRATCH;
+		b->next = gc_scratch;
+		gc_scratch = b;
+	}
+	clos = (closure *)gc_scratch->free;
+	gc_scratch->free += CLOSURE_BYTES(size);
 	clos->tag = tag;
+	clos->size = size;
 	clos->gc = GC_USED;
-	prepend_list(&gc_closure_list, clos);
-	++gc_closure_list_sz;
+	++gc_stats.scratch;
 	return clos;
 }
 
+void gc_pop_scratch(closure *clos)
+{
+	ASSERT((char *)clos + CLOSURE_BYTES(clos->size) == gc_scratch->free);
+	erase_closure(clos);
+	gc_scratch->free = (char *)clos;
+	if(gc_scratch->free == BLOCK_START(gc_scratch) && gc_scratch->next) {
+		block *b = gc_scratch;
+		gc_scratch = b->next;
+		if(gc_scratch_spare)
+			free_block(gc_scratch_spare);
+		gc_scratch_spare = b;
+	}
+}
+
+int gc_is_scratch(closure *clos)
+{
+	return BLOCK_OF(UNTAG(clos))->flags & BLOCK_SCRATCH;
+}
+
+int gc_is_compact(closure *clos)
+{
+	return BLOCK_OF(UNTAG(clos))->flags & BLOCK_COMPACT;
+}
+
 entry *new_entry(char tag)
 {
 	entry *ent;
-	if(gc_closure_list_sz + gc_entry_list_sz > 2 * last_collection)
-		gc_collect();
-
-	ent = allocate(entry);
+	if(!gc_entry_blocks || gc_entry_blocks->free + sizeof(entry)
+		> BLOCK_END(gc_entry_blocks)) {
+		block *b = alloc_block();
+		b->next = gc_entry_blocks;
+		gc_entry_blocks = b;
+	}
+	ent = (entry *)gc_entry_blocks->free;
+	gc_entry_blocks->free += sizeof(entry);
 	ent->tag = tag;
-	ent->gc = GC_USED;
-	prepend_list(&gc_entry_list, ent);
-	++gc_entry_list_sz;
+	if(tag == ENTRY_LETREC) {
+		ent->u.letrec.frame_mask = NULL;
+		ent->u.letrec.shared = NULL;
+	}
+	if(tag == ENTRY_REF) {
+		ent->u.ref = NULL;
+		if(gc_entry_refs_sz == gc_entry_refs_cap) {
+			gc_entry_refs_cap = gc_entry_refs_cap ? 2 * gc_entry_refs_cap
+				: 0x100;
+			gc_entry_refs = reallocate_arr(entry *, gc_entry_refs,
+				gc_entry_refs_cap);
+		}
+		gc_entry_refs[gc_entry_refs_sz++] = ent;
+	}
+	++gc_entry_count;
 	return ent;
 }
+
+gc_compact *gc_new_compact(void)
+{
+	gc_compact *r = allocate(gc_compact);
+	r->blocks = NULL;
+	r->large = NULL;
+	r->bytes = 0;
+	r->held = 1;
+	r->marked = 0;
+	r->next = gc_regions;
+	gc_regions = r;
+	return r;
+}
+
+#define COMPACT_ROOM (BLOCK_SIZE - sizeof(block))
+
+static void *compact_alloc(gc_compact *r, size_t bytes)
+{
+	void *p;
+	bytes = (bytes + BLOCK_GRANULE - 1) / BLOCK_GRANULE * BLOCK_GRANULE;
+	if(!bytes)
+		return NULL;
+	r->bytes += bytes;
+	gc_compact_bytes += bytes;
+	if(bytes > COMPACT_ROOM) {
+		p = do_alloc(bytes);
+		prepend_list(&r->large, p);
+		return p;
+	}
+	if(!r->blocks || r->blocks->free + bytes > BLOCK_END(r->blocks)) {
+		block *b = alloc_block();
+		b->flags = BLOCK_COMPACT;
+		b->owner = r;
+		b->next = r->blocks;
+		r->blocks = b;
+	}
+	p = r->blocks->free;
+	r->blocks->free += bytes;
+	return p;
+}
+
+/* Copy a closure into a region, without filling in its fields */
+static closure *compact_shell(gc_compact *r, closure *src)
+{
+	closure *clos;
+	arity n = 0;
+	switch(src->tag) {
+	case CLOSURE_PRIM:
+		break;
+	case CLOSURE_CONSTR:
+		n = src->u.constr.nfields;
+		break;
+	case CLOSURE_THUNK:
+		if(src->u.thunk.want_arity)
+			panic("Can't compact a function");
+		/* fallthrough */
+	case CLOSURE_BLACKHOLE:
+		panic("Can't compact an unevaluated closure");
+		return NULL;
+	default:
+		panic("Unknown closure type %d", (int)src->tag);
+		return NULL;
+	}
+	/* The closure itself has to be in a block for BLOCK_COMPACT to be seen */
+	if(CLOSURE_BYTES(n) > COMPACT_ROOM)
+		n = 0;
+	clos = compact_alloc(r, CLOSURE_BYTES(n));
+	clos->tag = src->tag;
+	clos->gc = GC_OLD;
+	clos->size = n;
+	if(src->tag == CLOSURE_PRIM) {
+		clos->u.prim.size = src->u.prim.size;
+		clos->u.prim.mut = 0;
+		if(src->u.prim.size > sizeof(prim_word))
+			clos->u.prim.data.ptr = compact_alloc(r, src->u.prim.size);
+		memcpy(CLOSURE_PRIM_DATA(clos), CLOSURE_PRIM_DATA(src),
+			src->u.prim.size);
+	} else {
+		clos->u.constr.var = src->u.constr.var;
+		clos->u.constr.want_arity = src->u.constr.want_arity;
+		clos->u.constr.nfields = src->u.constr.nfields;
+		if(clos->u.constr.nfields > n)
+			clos->u.constr.spill = compact_alloc(r,
+				clos->u.constr.nfields * sizeof(closure *));
+	}
+	return clos;
+}
+
+/* Copies made so far by gc_compact_add, an open addressing hash table from
+ * originals to copies
+ */
+typedef struct compact_copy {
+	closure *from;
+	closure *to;
+} compact_copy;
+
+static size_t copy_slot(compact_copy *tab, size_t cap, closure *from)
+{
+	size_t i = (size_t)from / BLOCK_GRANULE * 2654435761u & (cap - 1);
+	while(tab[i].from && tab[i].from != from)
+		i = (i + 1) & (cap - 1);
+	return i;
+}
+
+closure *gc_compact_add(gc_compact *r, closure *root)
+{
+	size_t cap = 0x100, cnt = 0, i;
+	compact_copy *tab = allocate_arr(compact_copy, cap);
+	mark_stack todo = { NULL, 0, 0 };
+	closure *copy;
+	ASSERT(r->held);
+	/* Like a new closure, the copy may be stored where marking has been */
+	if(gc_marking)
+		r->marked = 1;
+	memset(tab, 0, cap * sizeof(compact_copy));
+	init_statics();
+	root = deref(root);
+	copy = compact_shell(r, root);
+	tab[copy_slot(tab, cap, root)].from = root;
+	tab[copy_slot(tab, cap, root)].to = copy;
+	++cnt;
+	grow_stack(&todo, 1);
+	todo.items[todo.sz++] = root;
+	while(todo.sz) {
+		closure *src = todo.items[--todo.sz], **fields;
+		closure *dest = tab[copy_slot(tab, cap, src)].to;
+		if(src->tag != CLOSURE_CONSTR)
+			continue;
+		fields = CLOSURE_FIELDS(dest);
+		for(i = 0; i < src->u.constr.nfields; ++i) {
+			closure *from = deref(CLOSURE_FIELDS(src)[i]), *shared;
+			size_t slot;
+			if((shared = static_instance(from))) {
+				fields[i] = tag_pointer(shared);
+				continue;
+			}
+			slot = copy_slot(tab, cap, from);
+			if(!tab[slot].from) {
+				if(2 * (cnt + 1) > cap) {
+					compact_copy *old = tab;
+					size_t j;
+					tab = allocate_arr(compact_copy, 2 * cap);
+					memset(tab, 0, 2 * cap * sizeof(compact_copy));
+					for(j = 0; j < cap; ++j)
+						if(old[j].from)
+							tab[copy_slot(tab, 2 * cap, old[j].from)] = old[j];
+					cap *= 2;
+					unallocate(old);
+					slot = copy_slot(tab, cap, from);
+				}
+				tab[slot].from = from;
+				tab[slot].to = compact_shell(r, from);
+				++cnt;
+				grow_stack(&todo, todo.sz + 1);
+				todo.items[todo.sz++] = from;
+			}
+			/* Nothing in a region is ever unevaluated, so all of it's tagged */
+			fields[i] = tag_pointer(tab[slot].to);
+		}
+	}
+	unallocate(todo.items);
+	unallocate(tab);
+	return copy;
+}
+
+static void free_region(gc_compact *r)
+{
+	while(r->blocks) {
+		block *b = r->blocks;
+		r->blocks = b->next;
+		free_block(b);
+	}
+	while(r->large) {
+		unallocate(r->large->ptr);
+		erase_list(&r->large);
+	}
+	gc_compact_bytes -= r->bytes;
+	unallocate(r);
+}
+
+void gc_free_compact(gc_compact *r)
+{
+	r->held = 0;
+}
+
+/* Free the regions the program has let go of that the major collection just
+ * completed didn't reach
+ */
+static void sweep_regions(void)
+{
+	gc_compact **pr = &gc_regions;
+	while(*pr) {
+		gc_compact *r = *pr;
+		if(!r->held && !r->marked) {
+			*pr = r->next;
+			free_region(r);
+		} else {
+			pr = &r->next;
+		}
+	}
+}
+
+/* Static closures live in a region of their own */
+static gc_compact *gc_statics = NULL;
+static closure *gc_static_constrs[UCHAR_MAX + 1];
+/* For rts_opts.static_word_min to rts_opts.static_word_max */
+static closure **gc_static_words = NULL;
+static size_t gc_static_words_sz = 0;
+static long gc_static_words_min;
+
+static void init_statics(void)
+{
+	closure *clos;
+	size_t i;
+	if(gc_statics)
+		return;
+	gc_statics = gc_new_compact();
+	for(i = 0; i <= UCHAR_MAX; ++i) {
+		clos = gc_static_constrs[i] = compact_alloc(gc_statics,
+			CLOSURE_BYTES(0));
+		clos->tag = CLOSURE_CONSTR;
+		clos->gc = GC_OLD;
+		clos->size = 0;
+		clos->u.constr.var = i;
+		clos->u.constr.want_arity = 0;
+		clos->u.constr.nfields = 0;
+	}
+	gc_static_words_min = rts_opts.static_word_min;
+	gc_static_words_sz = rts_opts.static_word_max - gc_static_words_min + 1;
+	gc_static_words = allocate_arr(closure *, gc_static_words_sz);
+	for(i = 0; i < gc_static_words_sz; ++i) {
+		clos = gc_static_words[i] = compact_alloc(gc_statics,
+			CLOSURE_BYTES(0));
+		clos->tag = CLOSURE_PRIM;
+		clos->gc = GC_OLD;
+		clos->size = 0;
+		clos->u.prim.size = sizeof(long);
+		clos->u.prim.mut = 0;
+		clos->u.prim.data.word = gc_static_words_min + (long)i;
+	}
+}
+
+closure *gc_static_constr(variant var)
+{
+	init_statics();
+	return gc_static_constrs[var];
+}
+
+closure *gc_static_word(long val)
+{
+	init_statics();
+	/* Wraps around for values below the minimum */
+	if((unsigned long)val - (unsigned long)gc_static_words_min
+		>= gc_static_words_sz)
+		return NULL;
+	return gc_static_words[(unsigned long)val
+		- (unsigned long)gc_static_words_min];
+}
+
+/* The static closure equal to an evaluated one, if there is one */
+static closure *static_instance(closure *clos)
+{
+	if(BLOCK_OF(clos)->flags & BLOCK_COMPACT)
+		return NULL;
+	switch(clos->tag) {
+	case CLOSURE_CONSTR:
+		if(clos->u.constr.nfields || clos->u.constr.want_arity)
+			return NULL;
+		return gc_static_constrs[clos->u.constr.var];
+	case CLOSURE_PRIM:
+		/* Updated in place, so it has to stay where it's referred to */
+		if(clos->u.prim.size != sizeof(long) || clos->u.prim.mut)
+			return NULL;
+		return gc_static_word(clos->u.prim.data.word);
+	default:
+		return NULL;
+	}
+}
@@ -1,26 +1,132 @@
 #ifndef GC_H_
 #define GC_H_
 
+#include <stdio.h>
+
 #include "closure.h"
 
-extern closure *new_closure(char tag);
+/* Allocate a closure with room for size payload pointers (fields or
+ * environment) inline.
+ */
+extern closure *new_closure(char tag, arity size);
 
+/* Allocate an entry. Entries are never freed. */
 extern entry *new_entry(char tag);
 
-/* Pin/unpin a GC "root" */
+/* Allocate a closure that won't outlive the evaluation step allocating it on
+ * the scratch stack, rather than on the heap. Scratch closures must be popped
+ * in the reverse order of pushing, and everything they refer to is kept alive
+ * until then. Nothing else may refer to them.
+ */
+extern closure *gc_push_scratch(char tag, arity size);
+extern void gc_pop_scratch(closure *);
+extern int gc_is_scratch(closure *);
+
+/* Pin/unpin a GC "root". Pinned and used closures stay where they are, but
+ * when the heap is compacted (see -c) any other closure may move during an
+ * allocation. Pointers to them can only be held onto through the heap, an
+ * evaluation frame, registered roots or an ENTRY_REF entry. Pins are kept in a
+ * table of their own, collections don't look for them in the heap.
+ */
 extern void gc_pin(closure *);
 extern void gc_unpin(closure *);
 
-/* Temporarily mark an object as being used */
-extern void gc_use_entry(entry *);
-extern void gc_unuse_entry(entry *);
+/* Temporarily mark a closure as being used. New closures start out used. */
 extern void gc_use_closure(closure *);
 extern void gc_unuse_closure(closure *);
 
-/* Diagnostic checks whether a pointer hasn't been deallocated */
+/* Closure pointers held in C variables, registered for as long as they're
+ * needed. The collector keeps alive what they point to, and updates them when
+ * it moves it. Registrations live on the C stack and are pushed and popped in
+ * LIFO order; slots may be NULL, and may be changed in the meantime.
+ */
+typedef struct gc_roots {
+	struct gc_roots *prev;
+	closure **slots;
+	size_t len;
+} gc_roots;
+
+extern void gc_push_roots(gc_roots *, closure **slots, size_t len);
+extern void gc_pop_roots(gc_roots *);
+
+/* Closures an evaluation is working with, kept alive by the collector. Frames
+ * live on the C stack and are pushed and popped in LIFO order.
+ */
+typedef struct gc_frame {
+	struct gc_frame *prev;
+	/* Thunk being evaluated, blackholed by collections under lazy
+	 * blackholing
+	 */
+	closure *self;
+	/* Environment still needed, len can be lowered as it stops being needed */
+	closure **env;
+	size_t len;
+} gc_frame;
+
+extern void gc_push_frame(gc_frame *, closure *self, closure **env,
+	size_t len);
+extern void gc_pop_frame(gc_frame *);
+
+/* A compact region holds copies of fully evaluated closures, in blocks of its
+ * own that the collector treats as a single object: it never traces into them,
+ * so keeping a large immutable structure in a region costs nothing per
+ * collection. A region is kept alive as a whole by any reference to a closure
+ * in it, and by the program until it lets go of it with gc_free_compact.
+ */
+typedef struct gc_compact gc_compact;
+
+extern gc_compact *gc_new_compact(void);
+
+/* Deep-copy everything reachable from a closure into a region, keeping
+ * sharing, and return the copy. Everything reachable has to be an evaluated
+ * constructor or primitive.
+ */
+extern closure *gc_compact_add(gc_compact *, closure *);
+
+/* Let go of a region. Its memory is reclaimed by the first major collection
+ * that finds nothing referring to the closures in it anymore. Nothing may be
+ * added to it afterwards.
+ */
+extern void gc_free_compact(gc_compact *);
+extern int gc_is_compact(closure *);
+
+/* Static closures shared by every occurrence of a nullary constructor, and of
+ * a word value (a primitive holding a long, as Int and Char are) in the range
+ * set by -W. gc_static_word returns NULL for values out of range. Collections
+ * redirect references to equal closures to these.
+ */
+extern closure *gc_static_constr(variant);
+extern closure *gc_static_word(long);
+
+/* Must be called before a closure is overwritten in place, so that the
+ * collector can keep track of old closures pointing to new ones.
+ */
+extern void gc_write_barrier(closure *);
+
+/* Account for memory a closure holds outside of its block */
+extern void gc_add_payload(size_t bytes);
+extern void gc_remove_payload(size_t bytes);
+
+/* Allocate and free the out-of-line data of a primitive, accounting for it.
+ * Data of at least -P bytes goes to the large-object space: it's mapped on its
+ * own, never moves, and is returned to the system as soon as it's freed.
+ *
+ * The data is reference counted: gc_share_prim_data gives a copy of a
+ * primitive its data, which is only freed along with the last primitive
+ * referring to it. Data in a compact region is copied instead.
+ * gc_unshare_prim_data gives a primitive data of its own to update.
+ */
+extern void *gc_alloc_prim_data(size_t bytes);
+extern void gc_free_prim_data(void *, size_t bytes);
+extern void *gc_share_prim_data(closure *);
+extern void *gc_unshare_prim_data(closure *);
+
+/* Diagnostic check whether a pointer hasn't been deallocated */
 extern int gc_live_closure(closure *);
-extern int gc_live_entry(entry *);
 
 extern void gc_collect();
 
+/* Print collector statistics gathered so far */
+extern void gc_print_stats(FILE *);
+
 #endif
@@ -1,251 +1,594 @@
-#include <limits.h>
+#include <string.h>
 
 #include "alloc.h"
 #include "closure.h"
+#include "flags.h"
 #include "gc.h"
 #include "nf.h"
 #include "util.h"
 
-static closure **mask_env(env_mask mask, closure **env)
+/* Number of variables selected by a mask from an environment of given size */
+static arity mask_count(env_mask mask, size_t len)
 {
-	size_t popcnt = 0, i, j;
-	closure **newenv;
-	if(!env || !mask)
-		return NULL;
-	for(i = 0; env[i]; ++i)
-		if(mask[i / CHAR_BIT] & (1 << (i % CHAR_BIT)))
+	arity popcnt = 0;
+	size_t i;
+	if(!mask)
+		return 0;
+	for(i = 0; i < len; ++i)
+		if(MASKED(mask, i))
 			++popcnt;
-	if(!popcnt)
-		return NULL;
-	newenv = allocate_arr(closure *, popcnt + 1);
-	newenv[popcnt] = NULL;
-	for(i = j = 0; env[i]; ++i)
-		if(mask[i / CHAR_BIT] & (1 << (i % CHAR_BIT)))
-			newenv[j++] = env[i];
-	return newenv;
-}
-
-static closure **mask_concat_env(env_mask mask, closure **env1, closure **env2)
-{
-	size_t popcnt1 = 0, popcnt2 = 0, i, j;
-	closure **newenv;
-	if(!env1)
-		return mask_env(mask, env2);
-	if(!env2)
-		return mask_env(mask, env1);
-	for(i = 0; env1[i]; ++i)
-		if(mask[i / CHAR_BIT] & (1 << (i % CHAR_BIT)))
-			++popcnt1;
-	for(i = 0; env2[i]; ++i)
-		if(mask[(popcnt1 + i) / CHAR_BIT] & (1 << ((popcnt1 + i) % CHAR_BIT)))
-			++popcnt2;
-	if(!(popcnt1 + popcnt2))
-		return NULL;
-	newenv = allocate_arr(closure *, popcnt1 + popcnt2 + 1);
-	newenv[popcnt1 + popcnt2] = NULL;
-	for(i = j = 0; env1[i]; ++i)
-		if(mask[i / CHAR_BIT] & (1 << (i % CHAR_BIT)))
-			newenv[j++] = env1[i];
-	for(i = 0; env2[i]; ++i)
-		if(mask[(popcnt1 + i) / CHAR_BIT] & (1 << ((popcnt1 + i) % CHAR_BIT)))
-			newenv[j++] = env2[i];
-	return newenv;
-}
-
-static closure **extend_env(closure **env, closure *arg)
-{
-	closure **newenv;
-	if(env) {
-		size_t cnt = 0, i;
-		while(env[cnt])
-			++cnt;
-		newenv = allocate_arr(closure *, cnt + 2);
-		newenv[cnt + 1] = NULL;
-		newenv[cnt] = arg;
-		for(i = 0; i < cnt; ++i)
-			newenv[i] = env[i];
-	} else {
-		newenv = allocate_arr(closure *, 2);
-		newenv[1] = NULL;
-		newenv[0] = arg;
+	return popcnt;
+}
+
+/* Copy the variables selected by a mask from the concatenation of two
+ * environments into dest. Returns the number of variables copied.
+ */
+static arity mask_concat_copy(closure **dest, env_mask mask,
+	closure **env1, size_t len1, closure **env2, size_t len2)
+{
+	arity j = 0;
+	size_t i;
+	if(!mask)
+		return 0;
+	for(i = 0; i < len1; ++i)
+		if(MASKED(mask, i))
+			dest[j++] = env1[i];
+	for(i = 0; i < len2; ++i)
+		if(MASKED(mask, len1 + i))
+			dest[j++] = env2[i];
+	return j;
+}
+
+/* Allocate a thunk for a masked entry, closed over a subset of the given
+ * environment, on the heap or on the scratch stack.
+ */
+static closure *new_masked_thunk(masked_entry *me, closure **env, size_t len,
+	int scratch)
+{
+	arity cnt = mask_count(me->mask, len);
+	closure *clos = scratch ? gc_push_scratch(CLOSURE_THUNK, cnt)
+		: new_closure(CLOSURE_THUNK, cnt);
+	clos->u.thunk.want_arity = 0;
+	clos->u.thunk.entry = me->entry;
+	mask_concat_copy(init_env(clos, cnt), me->mask, env, len, NULL, 0);
+	if(!scratch)
+		gc_unuse_closure(clos);
+	return clos;
+}
+
+/* The closure a masked entry evaluates to: the variable itself if that's all
+ * it selects, a new thunk otherwise. A thunk that doesn't escape can go on the
+ * scratch stack. Either way the caller has to root it before anything else is
+ * allocated, and release it.
+ *
+ * Evaluation only ever writes into the closure being evaluated, and never
+ * stores a reference to it, so a closure that isn't bound in any environment
+ * can't escape. That's the case for the scrutinee of a case and for a
+ * function being applied, whose values are taken apart right away.
+ */
+static closure *masked_closure(masked_entry *me, closure **env, size_t len,
+	int scratch)
+{
+	closure *clos;
+	if(me->entry->tag != ENTRY_SELECT)
+		return new_masked_thunk(me, env, len, scratch);
+	clos = masked_var(me->mask, me->entry->u.select_idx, env, len, NULL, 0);
+	ASSERT(clos);
+	return clos;
+}
+
+static void release_closure(closure *clos)
+{
+	if(gc_is_scratch(clos))
+		gc_pop_scratch(clos);
+}
+
+/* Overwrite a closure with a thunk closed over the given environment. The
+ * environment may already be the closure's own, even if it's been blackholed.
+ */
+static void set_thunk(closure *self, arity want_arity, closure **env,
+	size_t len, entry *ent)
+{
+	if((self->tag != CLOSURE_THUNK && self->tag != CLOSURE_BLACKHOLE)
+		|| env != CLOSURE_ENV(self)) {
+		closure **newenv;
+		gc_write_barrier(self);
+		erase_closure(self);
+		newenv = init_env(self, len);
+		if(len)
+			memcpy(newenv, env, len * sizeof(closure *));
+	}
+	self->tag = CLOSURE_THUNK;
+	self->u.thunk.want_arity = want_arity;
+	self->u.thunk.entry = ent;
+}
+
+/* Work out what the bindings of a letrec group need out of its environment,
+ * and give each of them an entry that starts by taking that out of the frame
+ * they share.
+ */
+static void init_shared(entry *ent, size_t cnt, size_t len)
+{
+	masked_entry *binds = ent->u.letrec.bindings;
+	size_t bytes = (len + cnt + CHAR_BIT - 1) / CHAR_BIT, i, j;
+	env_mask mask = allocate_arr(unsigned char, bytes);
+	memset(mask, 0, bytes);
+	ent->u.letrec.shared = allocate_arr(entry *, cnt);
+	for(i = 0; i < cnt; ++i) {
+		entry *bind = new_entry(ENTRY_BIND);
+		bind->u.bind.group = ent;
+		bind->u.bind.idx = i;
+		bind->u.bind.width = len + cnt;
+		ent->u.letrec.shared[i] = bind;
+		if(binds[i].mask)
+			for(j = 0; j < bytes; ++j)
+				mask[j] |= binds[i].mask[j];
+	}
+	ent->u.letrec.frame_mask = mask;
+}
+
+/* Bind the closures of a letrec group of several bindings. Rather than each
+ * getting its own copy of what it needs out of the environment and the group,
+ * they all refer to a single frame holding everything any of them needs, and
+ * only take their environment out of it once entered.
+ */
+static void bind_shared(entry *ent, closure **bindings, size_t cnt,
+	closure **env, size_t len)
+{
+	closure *shared;
+	arity fcnt;
+	size_t i;
+	if(!ent->u.letrec.shared)
+		init_shared(ent, cnt, len);
+	ASSERT(ent->u.letrec.shared[0]->u.bind.width == len + cnt);
+	fcnt = mask_count(ent->u.letrec.frame_mask, len + cnt);
+	shared = new_closure(CLOSURE_NULL, fcnt);
+	for(i = 0; i < cnt; ++i) {
+		bindings[i] = new_closure(CLOSURE_THUNK, 1);
+		bindings[i]->u.thunk.want_arity = 0;
+		bindings[i]->u.thunk.entry = ent->u.letrec.shared[i];
+		init_env(bindings[i], 1)[0] = shared;
 	}
-	return newenv;
+	shared->tag = CLOSURE_CONSTR;
+	shared->u.constr.var = 0;
+	shared->u.constr.want_arity = 0;
+	mask_concat_copy(init_fields(shared, fcnt), ent->u.letrec.frame_mask,
+		env, len, bindings, cnt);
+	gc_unuse_closure(shared);
 }
 
-static int materialize(closure *self, closure **env, entry *ent);
+/* The evaluator runs on a stack of its own rather than on the C stack, so that
+ * tail calls take no space and evaluations may nest as deep as -K allows. Each
+ * frame is a thunk under evaluation, either running entry code or waiting for
+ * the value of another closure to carry on. Frames live in chunks that never
+ * move, and each is registered with the collector as long as it's in use.
+ */
+enum cont_kind {
+	/* Running the entry code of the frame */
+	CONT_RUN,
+	/* Waiting for a value to make the thunk an indirection to */
+	CONT_UPDATE,
+	/* Waiting for the function in slots[0] to apply it to slots[1] */
+	CONT_APPLY,
+	/* Waiting for the scrutinee in slots[0] to take a branch of the entry */
+	CONT_CASE
+};
+
+/* Environments up to this size are moved into the frame when blackholing */
+#define ENV_INLINE 8
 
-/* Same as materialize but take ownership of the environment */
-static void materialize_free_env(closure *self, closure **env, entry *ent)
+typedef struct cont {
+	char kind;
+	entry *ent;
+	gc_frame frame;
+	/* The environment of the frame if it's to be freed along with it */
+	closure **owned;
+	closure *slots[2];
+	gc_roots roots;
+	closure *buf[ENV_INLINE];
+} cont;
+
+#define CONT_CHUNK 0x100
+
+typedef struct cont_chunk {
+	struct cont_chunk *prev;
+	cont conts[CONT_CHUNK];
+} cont_chunk;
+
+/* The top chunk of the stack and how much of it is used, and an emptied chunk
+ * kept around so that pushing and popping across a chunk boundary doesn't
+ * allocate
+ */
+static cont_chunk *stack_chunk = NULL;
+static cont_chunk *stack_spare = NULL;
+static size_t stack_used = 0;
+static size_t stack_depth = 0;
+
+static cont *top_cont(void)
 {
-	materialize(self, env, ent);
-	unallocate(env);
+	ASSERT(stack_used);
+	return &stack_chunk->conts[stack_used - 1];
 }
 
-/* Apply the given function to the given argument and reduce the result to whnf
- * placing it into the given closure. Takes ownership of the function and the
- * argument closure.
+static cont *push_cont(void)
+{
+	if(rts_opts.stack_max && (stack_depth + 1) * sizeof(cont)
+		> rts_opts.stack_max)
+		panic("Stack overflow: %lu frames",
+			(long unsigned)stack_depth);
+	if(!stack_chunk || stack_used == CONT_CHUNK) {
+		cont_chunk *chunk = stack_spare ? stack_spare : allocate(cont_chunk);
+		stack_spare = NULL;
+		chunk->prev = stack_chunk;
+		stack_chunk = chunk;
+		stack_used = 0;
+	}
+	++stack_depth;
+	return &stack_chunk->conts[stack_used++];
+}
+
+static void pop_cont(cont *c)
+{
+	ASSERT(c == top_cont());
+	gc_pop_frame(&c->frame);
+	unallocate(c->owned);
+	--stack_depth;
+	if(!--stack_used && stack_chunk->prev) {
+		unallocate(stack_spare);
+		stack_spare = stack_chunk;
+		stack_chunk = stack_chunk->prev;
+		stack_used = CONT_CHUNK;
+	}
+}
+
+/* Give the frame a new environment it owns, once the old one is done with */
+static void set_env(cont *c, closure **env, size_t len)
+{
+	unallocate(c->owned);
+	c->owned = env;
+	c->frame.env = env;
+	c->frame.len = len;
+}
+
+/* Push a frame evaluating a thunk. Under eager blackholing it's blackholed
+ * first, with its environment moved out into the frame.
  */
-static int apply(closure *self, closure *fun, closure *arg)
+static cont *enter_thunk(closure *self)
 {
-	ASSERT(gc_live_closure(self));
-	ASSERT(gc_live_closure(fun));
-	ASSERT(gc_live_closure(arg));
-	whnf_closure(fun);
-	switch(fun->tag) {
-	case CLOSURE_CONSTR:
-		ASSERT(self->u.constr.want_arity);
+	cont *c = push_cont();
+	closure **env = CLOSURE_ENV(self);
+	arity len = self->u.thunk.nenv;
+	c->kind = CONT_RUN;
+	c->ent = self->u.thunk.entry;
+	c->owned = NULL;
+	if(rts_opts.eager_blackholing) {
+		env = len > ENV_INLINE
+			? (c->owned = allocate_arr(closure *, len)) : c->buf;
+		memcpy(env, CLOSURE_ENV(self), len * sizeof(closure *));
+		gc_write_barrier(self);
 		erase_closure(self);
-		self->tag = CLOSURE_CONSTR;
-		self->u.constr.var = fun->u.constr.var;
-		self->u.constr.want_arity = fun->u.constr.want_arity - 1;
-		self->u.constr.fields = extend_env(fun->u.constr.fields, arg);
-		gc_unuse_closure(fun);
-		gc_unuse_closure(arg);
-		return 0;
+		self->tag = CLOSURE_BLACKHOLE;
+		self->u.thunk.nenv = 0;
+	}
+	gc_push_frame(&c->frame, self, env, len);
+	return c;
+}
+
+/* Whether there's nothing to do to get a closure to whnf */
+static int evaluated(closure *clos)
+{
+	if(PTR_TAG(clos))
+		return 1;
+	switch(clos->tag) {
+	case CLOSURE_PRIM:
+	case CLOSURE_CONSTR:
+	case CLOSURE_IND:
+		return 1;
 	case CLOSURE_THUNK:
-		{
-			closure **newenv;
-			entry *newent = fun->u.thunk.entry;
-			ASSERT(fun->u.thunk.want_arity);
-			if(fun->u.thunk.want_arity == 1) {
-				newenv = extend_env(fun->u.thunk.env, arg);
-				gc_unuse_closure(fun);
-				gc_unuse_closure(arg);
-				materialize_free_env(self, newenv, newent);
-			} else {
-				erase_closure(self);
-				self->tag = CLOSURE_THUNK;
-				self->u.thunk.entry = fun->u.thunk.entry;
-				self->u.thunk.want_arity = fun->u.thunk.want_arity - 1;
-				self->u.thunk.env = extend_env(fun->u.thunk.env, arg);
-				gc_unuse_closure(fun);
-				gc_unuse_closure(arg);
-			}
-			return 0;
-		}
+		return clos->u.thunk.want_arity != 0;
+	case CLOSURE_BLACKHOLE:
+		panic("<<loop>>");
+		return 0;
 	default:
-		panic("Invalid closure type for apply %d", (int)fun->tag);
+		panic("Unknown closure type %d", (int)clos->tag);
 		return 0;
 	}
 }
 
-/* Evaluate the given entry code in the given environment, storing the result
- * in the given closure. It is assumed that the closure is provided used, and
- * that the environment and the entry code might be invalidated when something
- * else is entered. Return int so we can tail call.
+/* Run the entry code of a frame, storing the result in its thunk. Returns NULL
+ * once that's done, or the closure the frame is left waiting for the value of.
+ * The environment is let go of as soon as it isn't needed anymore.
  */
-static int materialize(closure *self, closure **env, entry *ent)
-{
-	ASSERT(ent);
-	ASSERT(gc_live_closure(self));
-	ASSERT(gc_live_entry(ent));
-	switch(ent->tag) {
-	case ENTRY_PRIM:
-		ASSERT(self->tag == CLOSURE_THUNK && self->u.thunk.env == env);
-		return ent->u.prim(self);
-	case ENTRY_REF:
-		{
-			closure *ref = ent->u.ref;
-			gc_use_closure(ref);
-			whnf_closure(ref); /* TODO: tail call */
-			copy_closure(self, ref);
-			gc_unuse_closure(ref);
-			return 0;
-		}
-	case ENTRY_SELECT:
-		{
-			closure *tgt;
-			ASSERT(env);
-			tgt = env[ent->u.select_idx];
-			gc_use_closure(tgt);
-			whnf_closure(tgt);
-			copy_closure(self, tgt);
-			gc_unuse_closure(tgt);
-			return 0;
+static closure *run_entry(cont *c)
+{
+	closure *self = c->frame.self;
+	for(;;) {
+		closure **env = c->frame.env;
+		size_t len = c->frame.len;
+		entry *ent = c->ent;
+		switch(ent->tag) {
+		case ENTRY_PRIM:
+			{
+				int blackholed = self->tag == CLOSURE_BLACKHOLE;
+				set_thunk(self, 0, env, len, ent);
+				/* Still under evaluation while the primitive runs */
+				if(blackholed)
+					self->tag = CLOSURE_BLACKHOLE;
+				/* The collector leaves the environment of a blackhole to the
+				 * frame, so the frame has to hold the one the primitive reads
+				 */
+				if(env != CLOSURE_ENV(self)) {
+					set_env(c, NULL, 0);
+					c->frame.env = CLOSURE_ENV(self);
+					c->frame.len = len;
+				}
+				/* The primitive overwrites self with its result. Collections
+				 * while it runs may promote self, so what it stores has to be
+				 * remembered once it's done.
+				 */
+				gc_write_barrier(self);
+				ent->u.prim(self);
+				gc_write_barrier(self);
+				/* Overwritten along with self */
+				c->frame.env = NULL;
+				c->frame.len = 0;
+				return NULL;
+			}
+		case ENTRY_REF:
+			set_env(c, NULL, 0);
+			c->kind = CONT_UPDATE;
+			return ent->u.ref;
+		case ENTRY_SELECT:
+			{
+				closure *tgt;
+				ASSERT(ent->u.select_idx < len);
+				tgt = env[ent->u.select_idx];
+				set_env(c, NULL, 0);
+				c->kind = CONT_UPDATE;
+				return tgt;
+			}
+		case ENTRY_APPLY:
+			c->slots[0] = masked_closure(&ent->u.apply.fun, env, len, 1);
+			c->slots[1] = NULL;
+			gc_push_roots(&c->roots, c->slots, 2);
+			c->slots[1] = masked_closure(&ent->u.apply.arg, env, len, 0);
+			set_env(c, NULL, 0);
+			c->kind = CONT_APPLY;
+			return c->slots[0];
+		case ENTRY_CASE:
+			c->slots[0] = masked_closure(&ent->u.caseof.scrutinee, env, len,
+				1);
+			gc_push_roots(&c->roots, c->slots, 1);
+			c->kind = CONT_CASE;
+			return c->slots[0];
+		case ENTRY_LETREC:
+			{
+				closure **bindings;
+				closure **newenv;
+				masked_entry *binds = ent->u.letrec.bindings;
+				size_t cnt = 0, i;
+				arity newcnt;
+				while(binds[cnt].entry)
+					++cnt;
+				bindings = allocate_arr(closure *, cnt);
+				if(cnt > 1)
+					bind_shared(ent, bindings, cnt, env, len);
+				else if(cnt) {
+					arity bcnt = mask_count(binds[0].mask, len + 1);
+					bindings[0] = new_closure(CLOSURE_THUNK, bcnt);
+					bindings[0]->u.thunk.want_arity = 0;
+					bindings[0]->u.thunk.entry = binds[0].entry;
+					mask_concat_copy(init_env(bindings[0], bcnt),
+						binds[0].mask, env, len, bindings, 1);
+				}
+				newcnt = mask_count(ent->u.letrec.body.mask, len + cnt);
+				newenv = allocate_arr(closure *, newcnt);
+				mask_concat_copy(newenv, ent->u.letrec.body.mask, env, len,
+					bindings, cnt);
+				set_env(c, newenv, newcnt);
+				/* The frame keeps alive whatever the body needs */
+				for(i = 0; i < cnt; ++i)
+					gc_unuse_closure(bindings[i]);
+				unallocate(bindings);
+				c->ent = ent->u.letrec.body.entry;
+				continue;
+			}
+		case ENTRY_LAM:
+			set_thunk(self, 1, env, len, ent->u.lambda.body);
+			return NULL;
+		case ENTRY_BIND:
+			{
+				masked_entry *bind =
+					&ent->u.bind.group->u.letrec.bindings[ent->u.bind.idx];
+				env_mask fmask = ent->u.bind.group->u.letrec.frame_mask;
+				closure *shared, **fields, **newenv;
+				arity cnt;
+				size_t i, j = 0, k = 0;
+				ASSERT(len == 1);
+				shared = deref(env[0]);
+				fields = CLOSURE_FIELDS(shared);
+				cnt = mask_count(bind->mask, ent->u.bind.width);
+				newenv = allocate_arr(closure *, cnt);
+				for(i = 0; cnt && i < ent->u.bind.width; ++i)
+					if(MASKED(fmask, i)) {
+						if(MASKED(bind->mask, i))
+							newenv[k++] = fields[j];
+						++j;
+					}
+				set_env(c, newenv, cnt);
+				c->ent = bind->entry;
+				continue;
+			}
+		default:
+			panic("Unknown entry type %d", (int)ent->tag);
+			return NULL;
 		}
-	case ENTRY_APPLY:
+	}
+}
+
+/* Apply the evaluated function of a frame to its argument. Returns whether
+ * that leaves the frame running the body of the function, rather than done.
+ * The function may be on the scratch stack.
+ */
+static int apply(cont *c)
+{
+	closure *self = c->frame.self, *fun = c->slots[0], *arg = c->slots[1];
+	closure *val = deref(fun);
+	ASSERT(gc_live_closure(arg));
+	switch(val->tag) {
+	case CLOSURE_CONSTR:
 		{
-			closure *fun, *arg;
-			fun = new_closure(CLOSURE_THUNK);
-			fun->u.thunk.want_arity = 0;
-			fun->u.thunk.env = mask_env(ent->u.apply.fun.mask, env);
-			fun->u.thunk.entry = ent->u.apply.fun.entry;
-			arg = new_closure(CLOSURE_THUNK);
-			arg->u.thunk.want_arity = 0;
-			arg->u.thunk.env = mask_env(ent->u.apply.arg.mask, env);
-			arg->u.thunk.entry = ent->u.apply.arg.entry;
-			return apply(self, fun, arg);
-		}
-	case ENTRY_CASE:
-		{	
-			/* TODO: what if self is overwritten */
-			closure *scrut = new_closure(-1);
-			closure **newenv;
-			entry *newent;
-			variant var;
-			materialize_free_env(scrut,
-				mask_env(ent->u.caseof.scrutinee.mask, env),
-				ent->u.caseof.scrutinee.entry);
-			ASSERT(scrut->tag == CLOSURE_CONSTR && !scrut->u.constr.want_arity);
-			var = scrut->u.constr.var;
-			newenv = mask_concat_env(ent->u.caseof.branches[var].mask,
-				env, scrut->u.constr.fields);
-			newent = ent->u.caseof.branches[var].entry;
-			gc_unuse_closure(scrut);
-			materialize_free_env(self, newenv, newent);
+			closure **fields;
+			arity cnt = val->u.constr.nfields;
+			ASSERT(val->u.constr.want_arity);
+			gc_write_barrier(self);
+			erase_closure(self);
+			self->tag = CLOSURE_CONSTR;
+			self->u.constr.var = val->u.constr.var;
+			self->u.constr.want_arity = val->u.constr.want_arity - 1;
+			fields = init_fields(self, cnt + 1);
+			memcpy(fields, CLOSURE_FIELDS(val), cnt * sizeof(closure *));
+			fields[cnt] = tag_pointer(arg);
+			release_closure(fun);
 			return 0;
 		}
-	case ENTRY_LETREC:
+	case CLOSURE_THUNK:
 		{
-			closure **bindings;
 			closure **newenv;
-			entry *newent = ent->u.letrec.body.entry;
-			size_t cnt = 0, i;
-			while(ent->u.letrec.bindings[cnt].entry)
-				++cnt;
-			bindings = allocate_arr(closure *, cnt + 1);
-			bindings[cnt] = NULL;
-			for(i = 0; i < cnt; ++i)
-				bindings[i] = new_closure(CLOSURE_NULL);
-			for(i = 0; i < cnt; ++i) {
-				bindings[i]->tag = CLOSURE_THUNK;
-				bindings[i]->u.thunk.want_arity = 0;
-				bindings[i]->u.thunk.env = mask_concat_env(
-					ent->u.letrec.bindings[i].mask, env, bindings);
-				bindings[i]->u.thunk.entry = ent->u.letrec.bindings[i].entry;
+			arity cnt = val->u.thunk.nenv;
+			ASSERT(val->u.thunk.want_arity);
+			if(val->u.thunk.want_arity == 1) {
+				newenv = allocate_arr(closure *, cnt + 1);
+				memcpy(newenv, CLOSURE_ENV(val), cnt * sizeof(closure *));
+				newenv[cnt] = tag_pointer(arg);
+				c->ent = val->u.thunk.entry;
+				release_closure(fun);
+				set_env(c, newenv, cnt + 1);
+				return 1;
 			}
-			newenv = mask_concat_env(ent->u.letrec.body.mask, env, bindings);
-			unallocate(bindings);
-			materialize_free_env(self, newenv, newent);
+			gc_write_barrier(self);
+			erase_closure(self);
+			self->tag = CLOSURE_THUNK;
+			self->u.thunk.entry = val->u.thunk.entry;
+			self->u.thunk.want_arity = val->u.thunk.want_arity - 1;
+			newenv = init_env(self, cnt + 1);
+			memcpy(newenv, CLOSURE_ENV(val), cnt * sizeof(closure *));
+			newenv[cnt] = tag_pointer(arg);
+			release_closure(fun);
 			return 0;
 		}
-	case ENTRY_LAM:
-		ASSERT(self->tag == CLOSURE_THUNK && self->u.thunk.env == env);
-		self->u.thunk.want_arity = 1;
-		self->u.thunk.entry = ent->u.lambda.body;
-		return 0;
 	default:
-		panic("Unknown entry type %d", (int)ent->tag);
+		panic("Invalid closure type for apply %d", (int)val->tag);
 		return 0;
 	}
 }
 
-/* Return int so we can tail call */
-int whnf_closure(closure *self)
+/* Once a case has evaluated a variable of its environment, tag the variable so
+ * that cases over it in the branch don't have to look at it again
+ */
+static void tag_scrutinee(cont *c, closure *val)
 {
-	ASSERT(self);
-	ASSERT(gc_live_closure(self));
-	switch(self->tag) {
-	case CLOSURE_PRIM:
-	case CLOSURE_CONSTR:
-		return 0;
-	case CLOSURE_THUNK:
-		gc_use_closure(self);
-		if(self->u.thunk.want_arity)
-			return 0;
-		return materialize(self, self->u.thunk.env, self->u.thunk.entry);
+	masked_entry *scrut = &c->ent->u.caseof.scrutinee;
+	size_t i, j;
+	if(scrut->entry->tag != ENTRY_SELECT || !scrut->mask)
+		return;
+	j = scrut->entry->u.select_idx;
+	for(i = 0; i < c->frame.len; ++i)
+		if(MASKED(scrut->mask, i) && !j--) {
+			/* Pointing it past an indirection would need a write barrier */
+			if(c->frame.env[i] == val)
+				c->frame.env[i] = tag_pointer(val);
+			return;
+		}
+}
+
+/* Go on with the branch of a case the evaluated scrutinee of a frame picks. A
+ * tagged scrutinee tells the branch without a look at it, and is only
+ * dereferenced if the branch binds anything.
+ */
+static void take_branch(cont *c)
+{
+	closure *scrut = c->slots[0], *val = NULL, **fields = NULL, **newenv;
+	masked_entry *branch;
+	size_t len = c->frame.len;
+	arity cnt, nfields = 0;
+	int tag = PTR_TAG(scrut);
+	if(!tag || tag == PTR_TAG_EVALUATED) {
+		val = deref(scrut);
+		ASSERT(val->tag == CLOSURE_CONSTR && !val->u.constr.want_arity);
+		tag_scrutinee(c, val);
+		tag = val->u.constr.var + 1;
+	}
+	branch = &c->ent->u.caseof.branches[tag - 1];
+	if(branch->mask) {
+		if(!val)
+			val = deref(scrut);
+		ASSERT(val->tag == CLOSURE_CONSTR && !val->u.constr.want_arity);
+		nfields = val->u.constr.nfields;
+		fields = CLOSURE_FIELDS(val);
+	}
+	cnt = mask_count(branch->mask, len + nfields);
+	newenv = allocate_arr(closure *, cnt);
+	mask_concat_copy(newenv, branch->mask, c->frame.env, len, fields, nfields);
+	release_closure(scrut);
+	set_env(c, newenv, cnt);
+	c->ent = branch->entry;
+}
+
+/* Carry on with a frame now that what it waits for is in whnf. Returns like
+ * run_entry.
+ */
+static closure *resume(cont *c, closure *val)
+{
+	switch(c->kind) {
+	case CONT_UPDATE:
+		set_indirection(c->frame.self, val);
+		return NULL;
+	case CONT_APPLY:
+		gc_pop_roots(&c->roots);
+		c->kind = CONT_RUN;
+		return apply(c) ? run_entry(c) : NULL;
+	case CONT_CASE:
+		gc_pop_roots(&c->roots);
+		c->kind = CONT_RUN;
+		take_branch(c);
+		return run_entry(c);
 	default:
-		panic("Unknown closure type %d", (int)self->tag);
+		panic("Frame isn't waiting");
+		return NULL;
+	}
+}
+
+/* Frames below the depth whnf_closure is called at belong to evaluations
+ * further out, such as one running the primitive that calls it.
+ */
+int whnf_closure(closure *clos)
+{
+	size_t base = stack_depth;
+	cont *c;
+	closure *wait;
+	ASSERT(clos);
+	ASSERT(gc_live_closure(clos));
+	if(evaluated(clos))
 		return 0;
+	c = enter_thunk(clos);
+	wait = run_entry(c);
+	for(;;) {
+		if(wait) {
+			if(evaluated(wait))
+				wait = resume(c, wait);
+			else {
+				c = enter_thunk(wait);
+				wait = run_entry(c);
+			}
+			continue;
+		}
+		/* The thunk of the top frame holds its value now */
+		wait = c->frame.self;
+		pop_cont(c);
+		if(stack_depth == base)
+			return 0;
+		c = top_cont();
+		wait = resume(c, wait);
 	}
 }
@@ -4,7 +4,9 @@
 #include "closure.h"
 
 /* Reduce a closure to weak-head normal form, in place. That is, either a
- * primitive or an algebraic constructor, or a partially applied thunk.
+ * primitive or an algebraic constructor, or a partially applied thunk. The
+ * closure may end up an indirection to the value instead, see deref. A tagged
+ * pointer is known to be in whnf already.
  */
 extern int whnf_closure(closure *clos);
 
@@ -0,0 +1,619 @@
+#define _POSIX_C_SOURCE 200112L
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "alloc.h"
+#include "rts/flags.h"
+#include "rts/gc.h"
+#include "rts/nf.h"
+#include "util.h"
+
+/* Evaluator programs built by hand, with checks on their results. The runtime
+ * options given between +RTS and -RTS apply to all of them, `make check` runs
+ * them under each collector mode.
+ */
+
+static int failures = 0;
+
+static void check(int ok, char const *test, char const *what)
+{
+	if(ok)
+		return;
+	fprintf(stderr, "%s: %s\n", test, what);
+	++failures;
+}
+
+/* Masks, terminated by -1 */
+static env_mask mask(int first, ...)
+{
+	env_mask m = allocate_arr(unsigned char, 8);
+	va_list ap;
+	int i;
+	memset(m, 0, 8);
+	va_start(ap, first);
+	for(i = first; i >= 0; i = va_arg(ap, int))
+		m[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+	va_end(ap);
+	return m;
+}
+
+static entry *e_select(arity idx)
+{
+	entry *ent = new_entry(ENTRY_SELECT);
+	ent->u.select_idx = idx;
+	return ent;
+}
+
+static entry *e_prim(int (*prim)(closure *))
+{
+	entry *ent = new_entry(ENTRY_PRIM);
+	ent->u.prim = prim;
+	return ent;
+}
+
+static entry *e_ref(closure *clos)
+{
+	entry *ent = new_entry(ENTRY_REF);
+	ent->u.ref = clos;
+	return ent;
+}
+
+static entry *e_apply(env_mask fmask, entry *fun, env_mask amask, entry *arg)
+{
+	entry *ent = new_entry(ENTRY_APPLY);
+	ent->u.apply.fun.mask = fmask;
+	ent->u.apply.fun.entry = fun;
+	ent->u.apply.arg.mask = amask;
+	ent->u.apply.arg.entry = arg;
+	return ent;
+}
+
+/* A case over a datatype of two variants */
+static entry *e_case(env_mask smask, entry *scrut, env_mask mask0,
+	entry *branch0, env_mask mask1, entry *branch1)
+{
+	entry *ent = new_entry(ENTRY_CASE);
+	masked_entry *branches = allocate_arr(masked_entry, 3);
+	branches[0].mask = mask0;
+	branches[0].entry = branch0;
+	branches[1].mask = mask1;
+	branches[1].entry = branch1;
+	branches[2].mask = NULL;
+	branches[2].entry = NULL;
+	ent->u.caseof.scrutinee.mask = smask;
+	ent->u.caseof.scrutinee.entry = scrut;
+	ent->u.caseof.branches = branches;
+	return ent;
+}
+
+/* A letrec of one or two bindings, the second one may be NULL */
+static entry *e_letrec(env_mask mask0, entry *bind0, env_mask mask1,
+	entry *bind1, env_mask bmask, entry *body)
+{
+	entry *ent = new_entry(ENTRY_LETREC);
+	masked_entry *binds = allocate_arr(masked_entry, 3);
+	binds[0].mask = mask0;
+	binds[0].entry = bind0;
+	binds[1].mask = mask1;
+	binds[1].entry = bind1;
+	binds[2].mask = NULL;
+	binds[2].entry = NULL;
+	ent->u.letrec.body.mask = bmask;
+	ent->u.letrec.body.entry = body;
+	ent->u.letrec.bindings = binds;
+	return ent;
+}
+
+static closure *new_int(long val)
+{
+	closure *clos = new_closure(CLOSURE_PRIM, 0);
+	*(long *)init_prim(clos, sizeof(long)) = val;
+	return clos;
+}
+
+static closure *new_constr(variant var, arity want_arity)
+{
+	closure *clos = new_closure(CLOSURE_CONSTR, 0);
+	clos->u.constr.var = var;
+	clos->u.constr.want_arity = want_arity;
+	init_fields(clos, 0);
+	return clos;
+}
+
+static closure *new_thunk(entry *ent, arity nenv)
+{
+	closure *clos = new_closure(CLOSURE_THUNK, nenv);
+	clos->u.thunk.want_arity = 0;
+	clos->u.thunk.entry = ent;
+	init_env(clos, nenv);
+	return clos;
+}
+
+static long int_value(closure *clos)
+{
+	whnf_closure(clos);
+	clos = deref(clos);
+	ASSERT(clos->tag == CLOSURE_PRIM);
+	return *(long *)CLOSURE_PRIM_DATA(clos);
+}
+
+/* The value of a variable of the thunk a primitive is evaluating. Evaluating
+ * it may collect, so the variables are to be read again afterwards.
+ */
+static long int_arg(closure *self, arity idx)
+{
+	return int_value(CLOSURE_ENV(self)[idx]);
+}
+
+static void set_int(closure *self, long val)
+{
+	erase_closure(self);
+	self->tag = CLOSURE_PRIM;
+	*(long *)init_prim(self, sizeof(long)) = val;
+}
+
+static void set_bool(closure *self, int val)
+{
+	erase_closure(self);
+	self->tag = CLOSURE_CONSTR;
+	self->u.constr.var = val != 0;
+	self->u.constr.want_arity = 0;
+	init_fields(self, 0);
+}
+
+/* Allocate closures that die right away */
+static void garbage(size_t cnt)
+{
+	while(cnt--)
+		gc_unuse_closure(new_closure(CLOSURE_NULL, 2));
+}
+
+static int p_iszero(closure *self)
+{
+	set_bool(self, !int_arg(self, 0));
+	return 0;
+}
+
+static int p_dec(closure *self)
+{
+	set_int(self, int_arg(self, 0) - 1);
+	return 0;
+}
+
+static int p_add(closure *self)
+{
+	long a = int_arg(self, 0);
+	set_int(self, a + int_arg(self, 1));
+	return 0;
+}
+
+/* gen n = case iszero n of False -> Cons n (gen (dec n)); True -> Nil
+ * sum xs = case xs of Nil -> 0; Cons h t -> let r = sum t; s = add h r in s
+ * Both functions and the constructors stay pinned.
+ */
+static closure *gen_fn, *sum_fn, *cons_fn, *nil_val;
+
+static void init_list_fns(void)
+{
+	entry *scrut, *rest, *cons_n, *cons_branch, *rec, *add;
+	closure *zero;
+	if(gen_fn)
+		return;
+	cons_fn = new_constr(1, 2);
+	nil_val = new_constr(0, 0);
+	zero = new_int(0);
+	gc_pin(cons_fn);
+	gc_pin(nil_val);
+	gc_pin(zero);
+	gen_fn = new_thunk(NULL, 0);
+	gc_pin(gen_fn);
+	scrut = e_letrec(mask(0, -1), e_prim(p_iszero), NULL, NULL,
+		mask(1, -1), e_select(0));
+	rest = e_apply(NULL, e_ref(gen_fn), mask(0, -1), e_prim(p_dec));
+	cons_n = e_apply(NULL, e_ref(cons_fn), mask(0, -1), e_select(0));
+	cons_branch = e_apply(mask(0, -1), cons_n, mask(0, -1), rest);
+	gen_fn->u.thunk.want_arity = 1;
+	gen_fn->u.thunk.entry = e_case(mask(0, -1), scrut, mask(0, -1),
+		cons_branch, NULL, e_ref(nil_val));
+	sum_fn = new_thunk(NULL, 0);
+	gc_pin(sum_fn);
+	/* In the Cons branch the environment is [xs, h, t] and then [r, s] */
+	rec = e_apply(NULL, e_ref(sum_fn), mask(0, -1), e_select(0));
+	add = e_prim(p_add);
+	sum_fn->u.thunk.want_arity = 1;
+	sum_fn->u.thunk.entry = e_case(mask(0, -1), e_select(0), NULL,
+		e_ref(zero), mask(0, 1, 2, -1),
+		e_letrec(mask(2, -1), rec, mask(1, 3, -1), add,
+			mask(4, -1), e_select(0)));
+	gc_unuse_closure(cons_fn);
+	gc_unuse_closure(nil_val);
+	gc_unuse_closure(zero);
+	gc_unuse_closure(gen_fn);
+	gc_unuse_closure(sum_fn);
+}
+
+/* The list gen n, unevaluated */
+static closure *gen_list(long n)
+{
+	closure *len = new_int(n), *list;
+	gc_pin(len);
+	gc_unuse_closure(len);
+	list = new_thunk(e_apply(NULL, e_ref(gen_fn), NULL, e_ref(len)), 0);
+	return list;
+}
+
+/* Evaluate a list and its elements */
+static void force_list(closure *list)
+{
+	gc_roots roots;
+	gc_push_roots(&roots, &list, 1);
+	for(;;) {
+		whnf_closure(list);
+		if(!deref(list)->u.constr.var)
+			break;
+		whnf_closure(CLOSURE_FIELDS(deref(list))[0]);
+		list = CLOSURE_FIELDS(deref(list))[1];
+	}
+	gc_pop_roots(&roots);
+}
+
+static void test_list_sum(void)
+{
+	long n = 20000, sum = 0, len = 0;
+	closure *top, *list;
+	gc_roots roots;
+	init_list_fns();
+	/* Additions nest on the C stack, as primitives evaluate their arguments */
+	top = new_thunk(e_apply(NULL, e_ref(sum_fn), NULL,
+		gen_list(1000)->u.thunk.entry), 0);
+	gc_pin(top);
+	gc_unuse_closure(top);
+	check(int_value(top) == 1000L * 1001 / 2, "list_sum", "wrong sum");
+	gc_unpin(top);
+	/* Walk a list from C, collecting on the way */
+	list = gen_list(n);
+	gc_push_roots(&roots, &list, 1);
+	gc_unuse_closure(list);
+	for(;;) {
+		closure *cell;
+		whnf_closure(list);
+		cell = deref(list);
+		if(!cell->u.constr.var)
+			break;
+		sum += int_value(CLOSURE_FIELDS(cell)[0]);
+		list = CLOSURE_FIELDS(deref(list))[1];
+		if(++len % 997 == 0)
+			gc_collect();
+	}
+	gc_pop_roots(&roots);
+	check(len == n, "list_sum", "wrong length");
+	check(sum == n * (n + 1) / 2, "list_sum", "wrong sum of walked list");
+}
+
+/* Collects, so that self gets promoted through its frame, then stores a new
+ * closure into it
+ */
+static int p_box_after_collect(closure *self)
+{
+	closure *val;
+	gc_collect();
+	val = new_int(4242);
+	erase_closure(self);
+	self->tag = CLOSURE_CONSTR;
+	self->u.constr.var = 0;
+	self->u.constr.want_arity = 0;
+	init_fields(self, 1)[0] = val;
+	gc_unuse_closure(val);
+	return 0;
+}
+
+static void test_prim_barrier(void)
+{
+	closure *top = new_thunk(e_prim(p_box_after_collect), 0), *val;
+	gc_pin(top);
+	gc_unuse_closure(top);
+	whnf_closure(top);
+	/* Enough for minor collections */
+	garbage(200000);
+	val = CLOSURE_FIELDS(deref(top))[0];
+	check(gc_live_closure(val) && int_value(val) == 4242, "prim_barrier",
+		"field of a primitive's result lost");
+	gc_unpin(top);
+}
+
+/* Updates a survivor of a major collection before its block has been swept,
+ * then lets minor collections run
+ */
+static void test_sweep_barrier(void)
+{
+	closure *holder, *val;
+	/* Starts counting allocations from scratch, so that nothing promotes
+	 * holder before the major collection does
+	 */
+	gc_collect();
+	holder = new_closure(CLOSURE_CONSTR, 1);
+	holder->u.constr.var = 0;
+	holder->u.constr.want_arity = 0;
+	init_fields(holder, 1)[0] = new_int(0);
+	gc_unuse_closure(CLOSURE_FIELDS(holder)[0]);
+	gc_pin(holder);
+	gc_unuse_closure(holder);
+	/* Out of the block being bumped into, which is swept right away */
+	garbage(5000);
+	gc_collect();
+	/* Allocating might sweep the block holding it */
+	gc_write_barrier(holder);
+	val = new_int(4242);
+	CLOSURE_FIELDS(holder)[0] = val;
+	gc_unuse_closure(val);
+	garbage(200000);
+	val = CLOSURE_FIELDS(holder)[0];
+	check(gc_live_closure(val) && int_value(val) == 4242, "sweep_barrier",
+		"field stored before sweeping lost");
+	gc_unpin(holder);
+}
+
+/* Leaves most of the heap dead before reading its arguments, so that a
+ * compaction moves them
+ */
+static int p_add_after_collect(closure *self)
+{
+	garbage(50000);
+	gc_collect();
+	return p_add(self);
+}
+
+static void test_prim_compact(void)
+{
+	closure *top, *a, *b, **filler = allocate_arr(closure *, 50000);
+	size_t i;
+	/* Closures allocated before the arguments and dead by the time the
+	 * primitive runs, for them to be moved into
+	 */
+	for(i = 0; i < 50000; ++i)
+		filler[i] = new_int(0);
+	a = new_int(1000);
+	b = new_int(234);
+	for(i = 0; i < 50000; ++i)
+		gc_unuse_closure(filler[i]);
+	unallocate(filler);
+	/* The primitive runs in an environment of the frame's own */
+	top = new_thunk(e_letrec(mask(0, -1), e_select(0), NULL, NULL,
+		mask(0, 1, -1), e_prim(p_add_after_collect)), 2);
+	CLOSURE_ENV(top)[0] = a;
+	CLOSURE_ENV(top)[1] = b;
+	gc_pin(top);
+	gc_unuse_closure(top);
+	gc_unuse_closure(a);
+	gc_unuse_closure(b);
+	check(int_value(top) == 1234, "prim_compact",
+		"primitive read moved arguments");
+	gc_unpin(top);
+}
+
+/* A large structure that stays alive while lots of thunks are evaluated, so
+ * that major collections have work to do
+ */
+static void test_churn(void)
+{
+	closure *keep, *top;
+	int round;
+	init_list_fns();
+	keep = gen_list(100000);
+	gc_pin(keep);
+	gc_unuse_closure(keep);
+	force_list(keep);
+	for(round = 0; round < 20; ++round) {
+		top = new_thunk(e_apply(NULL, e_ref(sum_fn), NULL,
+			gen_list(1000)->u.thunk.entry), 0);
+		gc_pin(top);
+		gc_unuse_closure(top);
+		check(int_value(top) == 1000L * 1001 / 2, "churn", "wrong sum");
+		gc_unpin(top);
+		force_list(gen_list(20000));
+	}
+	gc_unpin(keep);
+}
+
+static void test_compact_region(void)
+{
+	closure *list, *copy, *holder;
+	gc_compact *region = gc_new_compact();
+	long sum = 0;
+	gc_roots roots;
+	init_list_fns();
+	list = gen_list(1000);
+	gc_push_roots(&roots, &list, 1);
+	gc_unuse_closure(list);
+	force_list(list);
+	copy = gc_compact_add(region, list);
+	gc_pop_roots(&roots);
+	/* Kept alive by the heap only from here on */
+	holder = new_closure(CLOSURE_CONSTR, 1);
+	holder->u.constr.var = 0;
+	holder->u.constr.want_arity = 0;
+	init_fields(holder, 1)[0] = copy;
+	gc_pin(holder);
+	gc_unuse_closure(holder);
+	gc_free_compact(region);
+	garbage(100000);
+	gc_collect();
+	gc_collect();
+	for(copy = CLOSURE_FIELDS(holder)[0]; deref(copy)->u.constr.var;
+		copy = CLOSURE_FIELDS(deref(copy))[1])
+		sum += int_value(CLOSURE_FIELDS(deref(copy))[0]);
+	check(sum == 1000L * 1001 / 2, "compact_region", "region lost");
+	gc_unpin(holder);
+	gc_collect();
+	gc_collect();
+}
+
+/* Share a word primitive through a constructor for collections to tidy */
+static closure *boxed_word(long val, int mutable)
+{
+	closure *box = new_closure(CLOSURE_CONSTR, 1), *word = new_int(val);
+	if(mutable)
+		prim_data_mut(word);
+	box->u.constr.var = 0;
+	box->u.constr.want_arity = 0;
+	init_fields(box, 1)[0] = word;
+	gc_pin(box);
+	gc_unuse_closure(box);
+	gc_unuse_closure(word);
+	return box;
+}
+
+static void test_mutable_prim(void)
+{
+	closure *box = boxed_word(0, 1), *word;
+	gc_collect();
+	word = CLOSURE_FIELDS(box)[0];
+	*(long *)prim_data_mut(word) = 1;
+	gc_collect();
+	check(int_value(CLOSURE_FIELDS(box)[0]) == 1, "mutable_prim",
+		"update lost");
+	check(!gc_static_word(0) || int_value(gc_static_word(0)) == 0,
+		"mutable_prim", "static word updated");
+	gc_unpin(box);
+}
+
+/* Run a test in a child process and check that it panics with a message
+ * starting with the given one
+ */
+static void expect_panic(char const *test, void (*body)(void),
+	char const *msg)
+{
+	int fds[2], status;
+	char buf[256];
+	ssize_t len = 0, got;
+	pid_t pid;
+	fflush(stdout);
+	fflush(stderr);
+	if(pipe(fds))
+		panic_errno("Could not create a pipe");
+	pid = fork();
+	if(pid < 0)
+		panic_errno("Could not fork");
+	if(!pid) {
+		close(fds[0]);
+		dup2(fds[1], 2);
+		body();
+		exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+	while(len < (ssize_t)sizeof(buf) - 1
+		&& (got = read(fds[0], buf + len, sizeof(buf) - 1 - len)) > 0)
+		len += got;
+	buf[len] = '\0';
+	close(fds[0]);
+	waitpid(pid, &status, 0);
+	check(WIFEXITED(status) && WEXITSTATUS(status) == EXIT_FAILURE
+		&& !strncmp(buf, msg, strlen(msg)), test, "didn't panic as expected");
+}
+
+static void mutate_static(void)
+{
+	closure *box = boxed_word(0, 0);
+	/* Incremental marking leaves the payloads it marks alone */
+	gc_collect();
+	gc_collect();
+	*(long *)prim_data_mut(CLOSURE_FIELDS(box)[0]) = 1;
+}
+
+/* Forces the selector in its environment, which selects the thunk being
+ * evaluated, after a collection that could shorten the selector
+ */
+static int p_force_after_collect(closure *self)
+{
+	gc_collect();
+	whnf_closure(CLOSURE_ENV(self)[0]);
+	return 0;
+}
+
+static void selector_loop(void)
+{
+	closure *pair = new_thunk(e_prim(p_force_after_collect), 1);
+	closure *sel = new_thunk(e_select(0), 1);
+	CLOSURE_ENV(pair)[0] = sel;
+	CLOSURE_ENV(sel)[0] = pair;
+	gc_pin(pair);
+	gc_unuse_closure(pair);
+	gc_unuse_closure(sel);
+	whnf_closure(pair);
+}
+
+/* A chain of n thunks each selecting the next, ending in a constructor */
+static closure *select_chain(long n)
+{
+	closure *prev = new_constr(0, 0), *clos = prev;
+	entry *sel = e_select(0);
+	gc_pin(prev);
+	gc_unuse_closure(prev);
+	while(n--) {
+		clos = new_thunk(sel, 1);
+		CLOSURE_ENV(clos)[0] = prev;
+		gc_pin(clos);
+		gc_unuse_closure(clos);
+		prev = clos;
+	}
+	return clos;
+}
+
+static void test_deep(void)
+{
+	closure *top = select_chain(100000), *cases;
+	entry *ent = e_select(0);
+	long i;
+	whnf_closure(top);
+	check(deref(top)->tag == CLOSURE_CONSTR, "deep", "wrong value");
+	/* Cases one inside the other run in a single frame */
+	for(i = 0; i < 100000; ++i)
+		ent = e_case(mask(0, -1), e_select(0), mask(0, -1), ent, NULL, NULL);
+	cases = new_thunk(ent, 1);
+	CLOSURE_ENV(cases)[0] = new_constr(0, 0);
+	gc_pin(cases);
+	gc_unuse_closure(cases);
+	gc_unuse_closure(CLOSURE_ENV(cases)[0]);
+	rts_opts.stack_max = 0x1000;
+	whnf_closure(cases);
+	check(deref(cases)->tag == CLOSURE_CONSTR, "deep", "wrong value");
+}
+
+static void self_loop(void)
+{
+	closure *clos = new_thunk(e_select(0), 1);
+	CLOSURE_ENV(clos)[0] = clos;
+	gc_pin(clos);
+	rts_opts.eager_blackholing = 0;
+	rts_opts.stack_max = 0x10000;
+	whnf_closure(clos);
+}
+
+int main(int argc, char **argv)
+{
+	size_t stack_max;
+	parse_rts_flags(&argc, argv);
+	stack_max = rts_opts.stack_max;
+	/* First, so that its arguments are bumped into fresh blocks */
+	test_prim_compact();
+	test_list_sum();
+	test_prim_barrier();
+	test_sweep_barrier();
+	test_churn();
+	test_compact_region();
+	test_mutable_prim();
+	expect_panic("mutate_static", mutate_static, "Can't update");
+	expect_panic("selector_loop", selector_loop, "<<loop>>");
+	test_deep();
+	rts_opts.stack_max = stack_max;
+	expect_panic("self_loop", self_loop, "Stack overflow");
+	if(rts_opts.gc_stats)
+		gc_print_stats(stderr);
+	return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}